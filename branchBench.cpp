@@ -0,0 +1,413 @@
+/* Predictor benchmark */
+// Times every predictor configuration over synthetic branch streams and over
+// recorded traces, without Pin, and checks that the different ways of running a
+// predictor agree. Each configuration is run over each stream as:
+//
+//   batch     SimulateBranches() on the class CreateBranchPredictorOfType() picks,
+//             in batches of -batch_size branches like the Pin tool
+//   runtime   the same with the runtime-sized classes (-static_predictors 0)
+//   virtual   predictAndTrain() through BranchPredictorInterface, one branch at a time
+//   split     getPrediction() and train() through BranchPredictorInterface
+//   kernel    a one-lane GshareSweepKernel (gshare only)
+//
+// Every run starts from a new predictor, and the fastest of -repeat runs is
+// reported as ns/branch and million branches per second. All variants of a
+// configuration must make the same number of correct predictions on a stream; if
+// any does not, it is reported and the benchmark exits with status 1.
+//
+// The synthetic streams are:
+//
+//   loops        loop branches with trip counts 2 to 33, each run to its exit
+//   alternating  branches repeating a fixed pattern of period 2 to 5
+//   random       4096 branches with random outcomes, which no predictor can learn
+//   correlated   pairs of branches where the second repeats or inverts the first
+//
+//   g++ -O2 -std=c++11 branchBench.cpp -o branchBench
+//   ./branchBench -sweep gshare:4096,tage:4096 trace.bpt
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "branchPredictors.h"
+#include "branchTrace.h"
+
+// Predictor types benchmarked when neither -BP_type nor -sweep is given
+//
+static const char *DEFAULT_BENCHMARK_TYPES = "always_taken,local,gshare,tournament,tage,perceptron,hybrid";
+
+/* A set of branches every configuration is run over */
+//
+struct BenchmarkStream {
+  std::string name;
+  std::vector<BranchEvent> events;
+};
+
+/* A branch predictor created through the interface, with a batch routine for its class */
+//
+struct BenchmarkedPredictor {
+  BranchPredictorInterface *predictor;
+  void (*simulateBatch)(BranchPredictorInterface *predictor, const BranchEvent *events, uint32_t numEvents, BranchPredictorStats &stats);
+};
+
+template <class Predictor>
+static void BenchmarkBranchBatch(BranchPredictorInterface *predictor, const BranchEvent *events, uint32_t numEvents, BranchPredictorStats &stats) {
+  SimulateBranches(*static_cast<Predictor *>(predictor), events, numEvents, stats);
+}
+
+/* Creates the predictor of a BenchmarkedPredictor for CreateBranchPredictorOfType() */
+//
+struct BenchmarkedPredictorFactory {
+  const BranchPredictorConfig &config;
+  BenchmarkedPredictor &benchmarked;
+
+  template <class Predictor>
+  void create() {
+    benchmarked.predictor = new Predictor(config);
+    benchmarked.simulateBatch = BenchmarkBranchBatch<Predictor>;
+  }
+};
+
+/* The ways of running a predictor that are compared */
+//
+enum BenchmarkVariant {
+  VARIANT_BATCH,
+  VARIANT_RUNTIME,
+  VARIANT_VIRTUAL,
+  VARIANT_SPLIT,
+  VARIANT_KERNEL,
+  NUM_VARIANTS
+};
+
+static const char *VARIANT_NAMES[NUM_VARIANTS] = {"batch", "runtime", "virtual", "split", "kernel"};
+
+/* Outcomes of a synthetic stream drawn from a xorshift generator, so every run sees the same stream */
+//
+class BenchmarkRandom {
+
+private:
+
+  uint64_t state;
+
+public:
+
+  BenchmarkRandom(uint64_t seed) : state(seed) {}
+
+  uint64_t next() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+  }
+};
+
+// PC of the i-th branch of a synthetic stream. The spacing is not a power of two,
+// so the branches do not all fall on the same low index bits
+//
+static uint64_t SyntheticBranchPC(uint64_t i) {
+  return 0x401000 + i * 0x2c + (i % 7);
+}
+
+// Fills the events of the four synthetic streams with numBranches branches each
+//
+static void CreateSyntheticStreams(uint64_t numBranches, std::vector<BenchmarkStream> &streams) {
+  BenchmarkRandom random(0x9e3779b97f4a7c15ULL);
+
+  BenchmarkStream loops;
+  loops.name = "loops";
+  for (uint64_t loop = 0; loops.events.size() < numBranches; loop = (loop + 1) % 32) {
+    uint64_t tripCount = loop + 2;
+    for (uint64_t i = 1; i <= tripCount && loops.events.size() < numBranches; i++) {
+      BranchEvent event = {SyntheticBranchPC(loop), i != tripCount};
+      loops.events.push_back(event);
+    }
+  }
+  streams.push_back(loops);
+
+  BenchmarkStream alternating;
+  alternating.name = "alternating";
+  for (uint64_t i = 0; i < numBranches; i++) {
+    uint64_t branch = i % 64;
+    uint64_t period = 2 + branch % 4;
+    BranchEvent event = {SyntheticBranchPC(branch), (i / 64) % period != 0};
+    alternating.events.push_back(event);
+  }
+  streams.push_back(alternating);
+
+  BenchmarkStream randomOutcomes;
+  randomOutcomes.name = "random";
+  for (uint64_t i = 0; i < numBranches; i++) {
+    uint64_t value = random.next();
+    BranchEvent event = {SyntheticBranchPC(value % 4096), ((value >> 32) & 1) != 0};
+    randomOutcomes.events.push_back(event);
+  }
+  streams.push_back(randomOutcomes);
+
+  // pair k: a random first branch, the second one repeats it for even k and
+  // inverts it for odd k, with a random unrelated branch in between
+  BenchmarkStream correlated;
+  correlated.name = "correlated";
+  while (correlated.events.size() + 3 <= numBranches) {
+    uint64_t value = random.next();
+    uint64_t pair = value % 256;
+    bool first = ((value >> 32) & 1) != 0;
+    BranchEvent events[3] = {
+      {SyntheticBranchPC(3 * pair),     first},
+      {SyntheticBranchPC(3 * pair + 1), ((value >> 33) & 1) != 0},
+      {SyntheticBranchPC(3 * pair + 2), pair % 2 == 0 ? first : !first},
+    };
+    correlated.events.insert(correlated.events.end(), events, events + 3);
+  }
+  streams.push_back(correlated);
+}
+
+// Reads every branch of the trace in fileName into a stream. Terminates the
+// benchmark if it cannot be read
+//
+static void ReadTraceStream(const std::string &fileName, std::vector<BenchmarkStream> &streams) {
+  std::ifstream file(fileName.c_str(), std::ios::binary);
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::vector<BranchTraceChunk> chunks;
+  if (!file.is_open() || !FindBranchTraceChunks(data.data(), data.size(), chunks)) {
+    std::cerr << "Error: " << fileName << " is not a readable branch trace. Benchmark will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  BenchmarkStream stream;
+  stream.name = fileName;
+  for (uint64_t i = 0; i < chunks.size(); i++) {
+    const BranchTraceChunk &chunk = chunks[i];
+    stream.events.resize(chunk.firstEvent + chunk.numEvents);
+    if (!DecodeBranchTraceChunk(data.data() + chunk.offset + sizeof(BranchTraceChunkHeader), chunk.payloadBytes, chunk.numEvents,
+                                stream.events.data() + chunk.firstEvent)) {
+      std::cerr << "Error: " << fileName << " has a corrupt chunk. Benchmark will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+  streams.push_back(stream);
+}
+
+// Runs a new predictor of config over events in the given variant and returns the
+// counters. seconds is set to the time of the run itself, not of creating the predictor
+//
+static BranchPredictorStats RunVariant(const BranchPredictorConfig &config, BenchmarkVariant variant, const std::vector<BranchEvent> &events,
+                                       uint32_t batchSize, double &seconds) {
+  BranchPredictorStats stats;
+  const BranchEvent *data = events.data();
+  uint64_t numEvents = events.size();
+
+  if (variant == VARIANT_KERNEL) {
+    std::vector<uint32_t> historyBits(1, config.globalHistoryBitsOrDefault());
+    GshareSweepKernel kernel(config.numEntries, historyBits);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < numEvents; i += batchSize) {
+      kernel.simulate(data + i, std::min<uint64_t>(batchSize, numEvents - i), &stats);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+  }
+
+  BenchmarkedPredictor benchmarked;
+  BenchmarkedPredictorFactory factory = {config, benchmarked};
+  CreateBranchPredictorOfType(config, factory, variant != VARIANT_RUNTIME);
+  BranchPredictorInterface *predictor = benchmarked.predictor;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (variant == VARIANT_BATCH || variant == VARIANT_RUNTIME) {
+    for (uint64_t i = 0; i < numEvents; i += batchSize) {
+      benchmarked.simulateBatch(predictor, data + i, std::min<uint64_t>(batchSize, numEvents - i), stats);
+    }
+  }
+  else if (variant == VARIANT_VIRTUAL) {
+    for (uint64_t i = 0; i < numEvents; i++) {
+      stats.record(predictor->predictAndTrain(data[i].pc, data[i].taken), data[i].taken);
+    }
+  }
+  else {
+    for (uint64_t i = 0; i < numEvents; i++) {
+      bool wasPredictedTaken = predictor->getPrediction(data[i].pc);
+      predictor->train(data[i].pc, data[i].taken);
+      stats.record(wasPredictedTaken, data[i].taken);
+    }
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  delete predictor;
+  return stats;
+}
+
+static void Usage() {
+  std::cerr << "Usage: branchBench [options] [trace...]" << std::endl
+            << "Times the predictors over synthetic branch streams and the given traces. The options are those of the Pin tool:" << std::endl
+            << "  -BP_type type            predictor type (all types when neither this nor -sweep is given)" << std::endl
+            << "  -num_BP_entries n        number of entries in a branch predictor (1024)" << std::endl
+            << "  -num_LHT_entries n       number of entries in the local history table (128)" << std::endl
+            << "  -local_history_bits n    local history length in bits (0: log2 of num_BP_entries)" << std::endl
+            << "  -global_history_bits n   global history length in bits (0: log2 of num_BP_entries, 200 for tage, 32 for perceptron)" << std::endl
+            << "  -hybrid_components list  predictor types combined by -BP_type hybrid, separated by + (local+gshare)" << std::endl
+            << "  -chooser_history_bits n  global history bits in the hybrid chooser index (0)" << std::endl
+            << "  -update_delay n          branches between the prediction of a branch and its update (0)" << std::endl
+            << "  -sweep list              several configurations, as for the Pin tool" << std::endl
+            << "  -batch_size n            branches per batch of the batch, runtime and kernel variants (4096)" << std::endl
+            << "and for the benchmark itself:" << std::endl
+            << "  -branches n              branches in each synthetic stream (10000000, 0: none)" << std::endl
+            << "  -repeat n                runs of every variant, the fastest is reported (3)" << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+static uint64_t ParseNumber(const char *option, const char *value) {
+  char *end;
+  uint64_t number = std::strtoull(value, &end, 0);
+  if (*value == '\0' || *end != '\0') {
+    std::cerr << "Error: " << option << " expects a number. Benchmark will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return number;
+}
+
+int main(int argc, char *argv[]) {
+  BranchPredictorConfig config;
+  config.type              = "";
+  config.numEntries        = 1024;
+  config.numLHTEntries     = 128;
+  config.localHistoryBits  = 0;
+  config.globalHistoryBits = 0;
+
+  std::string sweep;
+  std::vector<std::string> traceFiles;
+  uint64_t batchSize = 4096;
+  uint64_t numBranches = 10000000;
+  uint64_t repeat = 3;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option[0] != '-') {
+      traceFiles.push_back(option);
+      continue;
+    }
+    if (i + 1 == argc) {
+      Usage();
+    }
+    const char *value = argv[++i];
+    if      (option == "-BP_type")              config.type               = value;
+    else if (option == "-num_BP_entries")       config.numEntries         = ParseNumber(argv[i - 1], value);
+    else if (option == "-num_LHT_entries")      config.numLHTEntries      = ParseNumber(argv[i - 1], value);
+    else if (option == "-local_history_bits")   config.localHistoryBits   = ParseNumber(argv[i - 1], value);
+    else if (option == "-global_history_bits")  config.globalHistoryBits  = ParseNumber(argv[i - 1], value);
+    else if (option == "-hybrid_components")    config.hybridComponents   = value;
+    else if (option == "-chooser_history_bits") config.chooserHistoryBits = ParseNumber(argv[i - 1], value);
+    else if (option == "-update_delay")         config.updateDelay        = ParseNumber(argv[i - 1], value);
+    else if (option == "-sweep")                sweep                     = value;
+    else if (option == "-batch_size")           batchSize                 = ParseNumber(argv[i - 1], value);
+    else if (option == "-branches")             numBranches               = ParseNumber(argv[i - 1], value);
+    else if (option == "-repeat")               repeat                    = ParseNumber(argv[i - 1], value);
+    else                                        Usage();
+  }
+  if (batchSize == 0 || repeat == 0) {
+    std::cerr << "Error: -batch_size and -repeat must not be 0. Benchmark will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  if (sweep.empty() && config.type.empty()) {
+    sweep = DEFAULT_BENCHMARK_TYPES;
+  }
+
+  std::vector<BranchPredictorConfig> configs;
+  if (sweep.empty()) {
+    configs.push_back(config);
+  }
+  else if (!ParseSweepConfigs(sweep, config, configs)) {
+    std::cerr << "Error: Malformed -sweep list. Benchmark will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  for (uint32_t i = 0; i < configs.size(); i++) {
+    const char *error = CheckBranchPredictorConfig(configs[i]);
+    if (error) {
+      std::cerr << "Error: " << error << " Benchmark will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+
+    BenchmarkedPredictor benchmarked;
+    BenchmarkedPredictorFactory factory = {configs[i], benchmarked};
+    if (!CreateBranchPredictorOfType(configs[i], factory)) {
+      std::cerr << "Error: No such type of branch predictor. Benchmark will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    delete benchmarked.predictor;
+  }
+
+  std::vector<BenchmarkStream> streams;
+  if (numBranches > 0) {
+    CreateSyntheticStreams(numBranches, streams);
+  }
+  for (uint32_t i = 0; i < traceFiles.size(); i++) {
+    ReadTraceStream(traceFiles[i], streams);
+  }
+
+  std::cout << "Stream\tBranches\tBP_type\tnum_BP_entries\tupdate_delay\tVariant\tPrediction accuracy\tns/branch\tMbranches/s" << std::endl;
+  uint32_t mismatches = 0;
+  for (uint32_t s = 0; s < streams.size(); s++) {
+    const BenchmarkStream &stream = streams[s];
+    if (stream.events.empty()) {
+      continue;
+    }
+    for (uint32_t c = 0; c < configs.size(); c++) {
+      BranchPredictorStats reference;
+      for (uint32_t v = 0; v < NUM_VARIANTS; v++) {
+        BenchmarkVariant variant = (BenchmarkVariant)v;
+        // the sweep kernel updates every lane at once, it has no update delay
+        if (variant == VARIANT_KERNEL && (configs[c].type != "gshare" || configs[c].globalHistoryBitsOrDefault() > 64 ||
+                                          configs[c].updateDelay)) {
+          continue;
+        }
+
+        BranchPredictorStats stats;
+        double fastest = 0.0;
+        for (uint64_t r = 0; r < repeat; r++) {
+          double seconds;
+          stats = RunVariant(configs[c], variant, stream.events, batchSize, seconds);
+          if (r == 0 || seconds < fastest) {
+            fastest = seconds;
+          }
+        }
+
+        double numEvents = (double)stream.events.size();
+        std::cout << stream.name                                        << "\t"
+                  << stream.events.size()                               << "\t"
+                  << configs[c].type                                    << "\t"
+                  << configs[c].numEntries                              << "\t"
+                  << configs[c].updateDelay                             << "\t"
+                  << VARIANT_NAMES[v]                                   << "\t"
+                  << (double)stats.correctPredictionCount / numEvents   << "\t"
+                  << std::fixed << std::setprecision(3)
+                  << 1e9 * fastest / numEvents                          << "\t"
+                  << numEvents / fastest / 1e6                          << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+        std::cout << std::setprecision(6);
+
+        if (v == VARIANT_BATCH) {
+          reference = stats;
+        }
+        else if (stats.correctPredictionCount != reference.correctPredictionCount ||
+                 stats.predictedTakenBranchesCount != reference.predictedTakenBranchesCount) {
+          std::cerr << "Mismatch: " << configs[c].type << " " << configs[c].numEntries << " on " << stream.name << ": "
+                    << VARIANT_NAMES[v] << " made " << stats.correctPredictionCount << " correct predictions, batch "
+                    << reference.correctPredictionCount << "." << std::endl;
+          mismatches++;
+        }
+      }
+    }
+  }
+
+  if (mismatches) {
+    std::cerr << mismatches << " variants do not match the batch results." << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,381 @@
+#ifndef BRANCH_FRONT_END_H
+#define BRANCH_FRONT_END_H
+
+/* Models of the fetch path besides the direction predictors */
+// A set-associative branch target buffer for the targets of taken branches, a
+// return address stack for returns and a loop predictor for conditional branches
+// with a fixed trip count. Used by the Pin tool with -front_end. Like the direction
+// predictors nothing in here depends on Pin.
+//
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "branchPredictors.h"
+
+/* Sizes of the front-end models */
+//
+struct FrontEndConfig {
+  uint64_t numBTBEntries;
+  uint32_t numBTBWays;
+  uint32_t numRASEntries;
+  uint64_t numLoopEntries;
+};
+
+/* Counters of one front-end model */
+// lookups is how often the model was consulted, hits how often it had an entry for
+// the branch and correct how often that entry gave the right target or outcome.
+//
+struct FrontEndModelStats {
+  uint64_t lookups = 0;
+  uint64_t hits    = 0;
+  uint64_t correct = 0;
+
+  void record(bool hit, bool wasCorrect) {
+    lookups++;
+    if (hit) {
+      hits++;
+      if (wasCorrect)
+        correct++;
+    }
+  }
+
+  void merge(const FrontEndModelStats &other) {
+    lookups += other.lookups;
+    hits    += other.hits;
+    correct += other.correct;
+  }
+};
+
+/* Counters of all front-end models */
+// The BTB counts every taken branch except returns; indirectBTB counts the
+// indirect jumps and calls among them separately.
+//
+struct FrontEndStats {
+  FrontEndModelStats btb;
+  FrontEndModelStats indirectBTB;
+  FrontEndModelStats ras;
+  FrontEndModelStats loop;
+
+  void merge(const FrontEndStats &other) {
+    btb.merge(other.btb);
+    indirectBTB.merge(other.indirectBTB);
+    ras.merge(other.ras);
+    loop.merge(other.loop);
+  }
+};
+
+/* Set-associative branch target buffer with LRU replacement */
+// The set is the PC modulo the number of sets. Entries are tagged with the whole
+// PC, so branches never alias within a set.
+//
+class BranchTargetBuffer {
+
+private:
+
+  struct Entry {
+    uint64_t pc;
+    uint64_t target;
+    uint64_t lastUse;
+    bool valid;
+  };
+
+  std::vector<Entry> entries;
+  uint64_t numSets;
+  uint32_t ways;
+  uint64_t useClock;
+
+public:
+
+  BranchTargetBuffer(uint64_t numEntries, uint32_t numWays) : numSets(numEntries / numWays), ways(numWays), useClock(0) {
+    Entry empty = {0, 0, 0, false};
+    entries.assign(numSets * ways, empty);
+  }
+
+  // Looks up the target of the taken branch at pc and stores target in its
+  // entry, replacing the least recently used one of the set on a miss.
+  // Returns whether there was an entry and whether it had this target
+  void predictAndTrain(uint64_t pc, uint64_t target, bool &hit, bool &correctTarget) {
+    Entry *set = &entries[(pc % numSets) * ways];
+    Entry *victim = &set[0];
+    useClock++;
+
+    for (uint32_t w = 0; w < ways; w++) {
+      if (set[w].valid && set[w].pc == pc) {
+        hit = true;
+        correctTarget = set[w].target == target;
+        set[w].target = target;
+        set[w].lastUse = useClock;
+        return;
+      }
+      if (!set[w].valid || (victim->valid && set[w].lastUse < victim->lastUse)) {
+        victim = &set[w];
+      }
+    }
+
+    hit = false;
+    correctTarget = false;
+    victim->pc = pc;
+    victim->target = target;
+    victim->lastUse = useClock;
+    victim->valid = true;
+  }
+
+  void serialize(PredictorStateArchive &archive) {
+    archive.array(entries);
+    archive.value(useClock);
+  }
+};
+
+/* Circular return address stack */
+// A call pushes its return address, a return pops the predicted target. When the
+// stack is full the oldest address is overwritten, when it is empty a return has
+// no prediction.
+//
+class ReturnAddressStack {
+
+private:
+
+  std::vector<uint64_t> addresses;
+  uint32_t top;
+  uint32_t depth;
+
+public:
+
+  ReturnAddressStack(uint32_t numEntries) : addresses(numEntries, 0), top(0), depth(0) {}
+
+  void push(uint64_t returnAddress) {
+    top = (top + 1) % addresses.size();
+    addresses[top] = returnAddress;
+    if (depth < addresses.size()) {
+      depth++;
+    }
+  }
+
+  // Pops the predicted return address. Returns false if the stack is empty
+  bool pop(uint64_t &returnAddress) {
+    if (depth == 0) {
+      return false;
+    }
+    returnAddress = addresses[top];
+    top = (top + addresses.size() - 1) % addresses.size();
+    depth--;
+    return true;
+  }
+
+  void serialize(PredictorStateArchive &archive) {
+    archive.array(addresses);
+    archive.value(top);
+    archive.value(depth);
+    if (top >= addresses.size() || depth > addresses.size()) {
+      top = 0;
+      depth = 0;
+    }
+  }
+};
+
+/* Loop predictor */
+// Each entry follows one conditional branch, indexed by its PC modulo the number
+// of entries. A loop branch repeats the same outcome a number of times (the trip
+// count) and then goes the other way once, at the loop exit. The entry counts the
+// repeated outcomes since the last exit. The first trip sets the trip count, and
+// once LOOP_CONFIDENT more trips in a row had the same count, so four identical
+// trips, it predicts the exit at the end of the next trip.
+// The direction of the repeated outcome is learnt too: two exits in a row mean it
+// was the wrong way around. A confident entry is only replaced after
+// LOOP_MAX_AGE misses by other branches without a correct prediction in between.
+//
+class LoopPredictor {
+
+private:
+
+  static const uint8_t LOOP_CONFIDENT = 3;
+  static const uint8_t LOOP_MAX_AGE   = 7;
+  static const uint16_t LOOP_MAX_TRIP = 0xffff;
+
+  struct Entry {
+    uint64_t pc;
+    uint16_t tripCount;
+    uint16_t iteration;
+    uint8_t confidence;
+    uint8_t age;
+    bool loopDirection;
+    bool valid;
+  };
+
+  std::vector<Entry> entries;
+
+  // Learns the outcome of the branch of entry
+  static void train(Entry &entry, bool branchWasTaken) {
+    if (branchWasTaken == entry.loopDirection) {
+      if (entry.iteration == LOOP_MAX_TRIP) {
+        // too long to be predicted, start over
+        entry.iteration = 0;
+        entry.confidence = 0;
+      }
+      entry.iteration++;
+      return;
+    }
+
+    if (entry.iteration == 0) {
+      // the exit outcome repeats, so it is the loop direction
+      entry.loopDirection = branchWasTaken;
+      entry.iteration = 1;
+      entry.tripCount = 0;
+      entry.confidence = 0;
+      return;
+    }
+    if (entry.iteration == entry.tripCount) {
+      if (entry.confidence < LOOP_CONFIDENT)
+        entry.confidence++;
+    } else {
+      entry.tripCount = entry.iteration;
+      entry.confidence = 0;
+    }
+    entry.iteration = 0;
+  }
+
+public:
+
+  LoopPredictor(uint64_t numEntries) {
+    Entry empty = {0, 0, 0, 0, 0, false, false};
+    entries.assign(numEntries, empty);
+  }
+
+  // Trains on the conditional branch at pc. Returns whether the entry of the branch
+  // was confident enough to predict it, and the prediction
+  void predictAndTrain(uint64_t pc, bool branchWasTaken, bool &hit, bool &wasPredictedTaken) {
+    Entry &entry = entries[pc % entries.size()];
+    if (entry.valid && entry.pc == pc) {
+      hit = entry.confidence == LOOP_CONFIDENT;
+      wasPredictedTaken = entry.iteration == entry.tripCount ? !entry.loopDirection : entry.loopDirection;
+      if (hit && wasPredictedTaken == branchWasTaken) {
+        entry.age = LOOP_MAX_AGE;
+      }
+      train(entry, branchWasTaken);
+      return;
+    }
+
+    hit = false;
+    wasPredictedTaken = false;
+    if (entry.valid && entry.confidence == LOOP_CONFIDENT && entry.age > 0) {
+      entry.age--;
+      return;
+    }
+    entry.pc = pc;
+    entry.tripCount = 0;
+    entry.iteration = 1;
+    entry.confidence = 0;
+    entry.age = LOOP_MAX_AGE;
+    entry.loopDirection = branchWasTaken;
+    entry.valid = true;
+  }
+
+  void serialize(PredictorStateArchive &archive) {
+    archive.array(entries);
+  }
+};
+
+/* The front-end models simulated on one stream of branches, with their counters */
+//
+class FrontEndModel {
+
+private:
+
+  BranchTargetBuffer btb;
+  ReturnAddressStack ras;
+  LoopPredictor loop;
+
+public:
+
+  FrontEndStats stats;
+
+  FrontEndModel(const FrontEndConfig &config)
+    : btb(config.numBTBEntries, config.numBTBWays), ras(config.numRASEntries), loop(config.numLoopEntries) {}
+
+  void conditionalBranch(uint64_t pc, uint64_t target, bool branchWasTaken) {
+    bool hit, wasPredictedTaken;
+    loop.predictAndTrain(pc, branchWasTaken, hit, wasPredictedTaken);
+    stats.loop.record(hit, wasPredictedTaken == branchWasTaken);
+    if (branchWasTaken) {
+      takenBranch(pc, target, false);
+    }
+  }
+
+  // An unconditional jump, or the jump part of a call
+  void takenBranch(uint64_t pc, uint64_t target, bool indirect) {
+    bool hit, correctTarget;
+    btb.predictAndTrain(pc, target, hit, correctTarget);
+    stats.btb.record(hit, correctTarget);
+    if (indirect) {
+      stats.indirectBTB.record(hit, correctTarget);
+    }
+  }
+
+  void call(uint64_t pc, uint64_t target, uint64_t returnAddress, bool indirect) {
+    takenBranch(pc, target, indirect);
+    ras.push(returnAddress);
+  }
+
+  void ret(uint64_t target) {
+    uint64_t predictedTarget = 0;
+    bool hit = ras.pop(predictedTarget);
+    stats.ras.record(hit, predictedTarget == target);
+  }
+
+  // Saves or loads the tables, but not the counters
+  void serialize(PredictorStateArchive &archive) {
+    btb.serialize(archive);
+    ras.serialize(archive);
+    loop.serialize(archive);
+  }
+};
+
+// Checks the sizes in config. Returns a description of the first problem, or NULL
+// if the models can be built
+//
+inline const char *CheckFrontEndConfig(const FrontEndConfig &config) {
+  if (config.numBTBWays == 0 || config.numBTBEntries == 0 || config.numBTBEntries % config.numBTBWays != 0) {
+    return "-btb_entries must be a non-zero multiple of -btb_ways.";
+  }
+  if (config.numRASEntries == 0) {
+    return "-ras_entries must not be 0.";
+  }
+  if (config.numLoopEntries == 0) {
+    return "-loop_entries must not be 0.";
+  }
+  return NULL;
+}
+
+// Prints one line of counters for every front-end model
+//
+inline void WriteFrontEndReport(std::ostream &out, const FrontEndConfig &config, const FrontEndStats &stats) {
+  struct Row {
+    const char *name;
+    const FrontEndModelStats &stats;
+  };
+  const Row rows[] = {
+    {"BTB",            stats.btb},
+    {"Indirect BTB",   stats.indirectBTB},
+    {"RAS",            stats.ras},
+    {"Loop predictor", stats.loop},
+  };
+
+  out << std::endl
+      << "BTB entries:\t"            << config.numBTBEntries  << "\t(" << config.numBTBWays << "-way)" << std::endl
+      << "RAS entries:\t"            << config.numRASEntries  << std::endl
+      << "Loop predictor entries:\t" << config.numLoopEntries << std::endl
+      << std::endl
+      << "Model\tLookups\tHits\tCorrect\tHit rate\tAccuracy of hits" << std::endl;
+  for (uint32_t i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+    const FrontEndModelStats &row = rows[i].stats;
+    out << rows[i].name                                              << "\t"
+        << row.lookups                                               << "\t"
+        << row.hits                                                  << "\t"
+        << row.correct                                               << "\t"
+        << (row.lookups ? (double)row.hits / (double)row.lookups : 0.0) << "\t"
+        << (row.hits ? (double)row.correct / (double)row.hits : 0.0)    << std::endl;
+  }
+}
+
+#endif // BRANCH_FRONT_END_H
@@ -1,8 +1,17 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <cstdlib>
 #include <vector> 
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <x86intrin.h>
 #include "pin.H"
+#include "branchPredictors.h"
+#include "branchTrace.h"
+#include "branchFrontEnd.h"
 using std::cerr;
 using std::endl;
 using std::ios;
@@ -11,429 +20,1082 @@ using std::string;
 
 using namespace std;
 
-// Simulation will stop when this number of instructions have been executed
+// Number of branch batches that can be in flight between the application
+// thread and the simulator threads (-sim_threads)
 //
-#define STOP_INSTR_NUM 1000000000 // 1b instrs
+#define SIMULATOR_RING_BATCHES 64
 
-// Simulator heartbeat rate
+// Each application thread adds its instructions to the global count at least
+// this often, so heartbeat and stop points are exact within this many
+// instructions per thread (and exact with a single thread)
 //
-#define SIMULATOR_HEARTBEAT_INSTR_NUM 100000000 // 100m instrs
+#define INSTRUCTION_CHECK_INTERVAL 1000000
 
-/* Base branch predictor class */
-// You are highly recommended to follow this design when implementing your branch predictors
+// Rows reserved for the intervals of -intervals when the simulation has no stop point
 //
-class BranchPredictorInterface {
-public:
-  //This function returns a prediction for a branch instruction with address branchPC
-  virtual bool getPrediction(ADDRINT branchPC) = 0;
-  
-  //This function updates branch predictor's history with outcome of branch instruction with address branchPC
-  virtual void train(ADDRINT branchPC, bool branchWasTaken) = 0;
+#define UNBOUNDED_INTERVAL_ROWS 1024
+
+ofstream OutFile;
+
+/* A branch predictor together with the configuration it was built from and its counters */
+//
+struct SimulatedPredictor {
+  BranchPredictorConfig config;
+  BranchPredictorInterface *predictor;
+  BranchPredictorStats stats;
+
+  // Counters per branch PC (-profile_branches), NULL if this predictor is not profiled
+  BranchProfile *profile = NULL;
+
+  // rdtsc cycles spent running this predictor over batches (-self_profile)
+  UINT64 simulationCycles = 0;
+
+  // Runs the predictor over a batch of branches without virtual calls,
+  // NULL when a GshareSweepGroup simulates it instead
+  VOID (*simulateBatch)(SimulatedPredictor &sim, const BranchEvent *events, UINT32 numEvents);
+
+  // Analysis routine used when this is the only predictor and branches are not buffered
+  AFUNPTR conditionalBranchRoutine;
 };
 
-// This is a class which implements always taken branch predictor
-class AlwaysTakenBranchPredictor : public BranchPredictorInterface {
-public:
-  AlwaysTakenBranchPredictor(UINT64 numberOfEntries) {}; //no entries here: always taken branch predictor is the simplest predictor
-	virtual bool getPrediction(ADDRINT branchPC) {
-		return true; // predict taken
-	}
-	virtual void train(ADDRINT branchPC, bool branchWasTaken) {} //nothing to do here: always taken branch predictor does not have history
+/* Fixed-size buffer of branches recorded by the analysis routine */
+// The predictors are run over the whole buffer when it fills up, one predictor
+// at a time, so the analysis routine itself is only a store and an increment.
+//
+struct BranchEventBuffer {
+  vector<BranchEvent> events;
+  UINT32 count = 0;
+};
+
+/* Gshare predictors of a PredictorSet that are simulated together (-sweep_kernel) */
+// Lane k of the kernel stands for predictors[members[k]] of the set, whose counters
+// it updates after every batch.
+//
+struct GshareSweepGroup {
+  GshareSweepKernel *kernel;
+  vector<UINT32> members;
+  vector<BranchPredictorStats> laneStats;
+};
+
+/* The predictors simulated on one stream of branches, and the counts of that stream */
+//
+struct PredictorSet {
+  vector<SimulatedPredictor> predictors;
+  vector<GshareSweepGroup> gshareGroups;
+  BranchStreamStats stream;
+
+  // BTB, RAS and loop predictor, NULL unless -front_end is set
+  FrontEndModel *frontEnd = NULL;
+
+  // counters of every -interval_instrs instructions, empty unless -intervals is set
+  BranchIntervalSeries intervals;
+
+  // counters of every detailed window, empty unless -sample_period is set
+  BranchIntervalSeries samples;
+
+  // Adds the counters of other, which simulated the same configurations on another stream
+  VOID merge(const PredictorSet &other) {
+    stream.merge(other.stream);
+    intervals.merge(other.intervals);
+    if (frontEnd) {
+      frontEnd->stats.merge(other.frontEnd->stats);
+    }
+    for (UINT32 i = 0; i < predictors.size(); i++) {
+      predictors[i].stats.merge(other.predictors[i].stats);
+      predictors[i].simulationCycles += other.predictors[i].simulationCycles;
+      if (predictors[i].profile) {
+        predictors[i].profile->merge(*other.predictors[i].profile);
+      }
+    }
+  }
+};
+
+/* Cycles spent in one part of the tool (-self_profile) */
+// Only timedCalls of the calls are timed, the cycles of the others are estimated
+// from their average
+//
+struct ProfiledRegion {
+  UINT64 calls      = 0;
+  UINT64 timedCalls = 0;
+  UINT64 cycles     = 0;
+
+  VOID record(UINT64 callCycles) {
+    timedCalls++;
+    cycles += callCycles;
+  }
+
+  double estimatedCycles() const {
+    return timedCalls ? (double)cycles * calls / timedCalls : 0.0;
+  }
+
+  VOID merge(const ProfiledRegion &other) {
+    calls      += other.calls;
+    timedCalls += other.timedCalls;
+    cycles     += other.cycles;
+  }
+};
+
+/* Where the analysis routines of one or all threads spent their cycles (-self_profile) */
+// The instruction count itself (docount()) is too short to be timed with rdtsc,
+// so only its calls are counted
+//
+struct SimulatorProfile {
+  UINT64 countCalls = 0;
+  ProfiledRegion countChecks;
+  ProfiledRegion branchRoutine;
+  ProfiledRegion bufferFlushes;
+
+  VOID merge(const SimulatorProfile &other) {
+    countCalls += other.countCalls;
+    countChecks.merge(other.countChecks);
+    branchRoutine.merge(other.branchRoutine);
+    bufferFlushes.merge(other.bufferFlushes);
+  }
+};
+
+/* State of one application thread */
+// With -thread_mode private every thread has predictors of its own and needs no
+// locking; they are merged into globalPredictors when the thread ends. With
+// -thread_mode shared, predictors points to globalPredictors and predictorsLock is
+// held while simulating. The analysis routines get this through a tool register.
+//
+struct ThreadState {
+  THREADID tid;
+  PredictorSet *predictors;
+  PIN_LOCK *predictorsLock;
+  PredictorSet privatePredictors;
+  BranchEventBuffer buffer;
+
+  // instructions executed by this thread, reported to the global count up to reportedICount
+  UINT64 iCount               = 0;
+  UINT64 reportedICount       = 0;
+  UINT64 nextInstructionCheck = 0;
+
+  // instruction count of this thread at which its next interval ends (-thread_mode private)
+  UINT64 nextIntervalEnd      = 0;
+
+  // whether the counters of a private set have been cleared at the end of -skip
+  BOOL countersReset          = false;
+
+  // cycles of the analysis routines of this thread, and the calls of the branch
+  // routine until the next one is timed (-self_profile)
+  SimulatorProfile profile;
+  UINT32 untilNextTimedBranch = 1;
 };
 
-//------------------------------------------------------------------------------
-//##############################################################################
+/* Ring of branch batches passed from the application thread to the simulator threads */
+// The application thread is the only producer. Every simulator thread reads every
+// batch, running its own share of the predictors over it, so a slot is only reused
+// once all consumers have moved past it. The head is written only by the producer
+// and each tail only by its consumer, which keeps the ring lock-free.
+//
+class BranchBatchRing {
 
- //LOCAL PREDICTOR
-class LocalBranchPredictor : public BranchPredictorInterface {
- 
 private:
-  
-  UINT64 numEntries;
- 
-public:
 
-  // for shifting the LHR
-  int PHTsize;
-  int LHR[128] = {};
-  vector<int> PHT;
+  // one cursor per cache line so that the threads do not false-share
+  struct Cursor {
+    std::atomic<UINT64> position;
+    char padding[64 - sizeof(std::atomic<UINT64>)];
+  };
+
+  vector<BranchEventBuffer> slots;
+  Cursor head;
+  std::unique_ptr<Cursor[]> tails;
+  UINT32 numConsumers;
+
+  UINT64 oldestUnconsumed() const {
+    UINT64 oldest = head.position.load(std::memory_order_relaxed);
+    for (UINT32 c = 0; c < numConsumers; c++) {
+      UINT64 tail = tails[c].position.load(std::memory_order_acquire);
+      if (tail < oldest) {
+        oldest = tail;
+      }
+    }
+    return oldest;
+  }
+
+public:
 
-  LocalBranchPredictor(UINT64 numberOfEntries) {
-    numEntries = numberOfEntries;
+  BranchBatchRing() : numConsumers(0) {
+    head.position.store(0);
+  }
 
-    // for shifting the LHR 
-    if (numEntries == 4096){
-      PHTsize = 0b111111111111;
+  VOID init(UINT32 numSlots, UINT32 batchSize, UINT32 consumers) {
+    slots.resize(numSlots);
+    for (UINT32 i = 0; i < numSlots; i++) {
+      slots[i].events.resize(batchSize);
     }
-    if (numEntries == 1024){
-      PHTsize = 0b1111111111;
+    numConsumers = consumers;
+    tails.reset(new Cursor[consumers]);
+    for (UINT32 c = 0; c < consumers; c++) {
+      tails[c].position.store(0);
     }
-    if (numEntries == 128){
-      PHTsize = 0b1111111;
+  }
+
+  // Producer: hands the branches in buffer over to the consumers, waiting for a free
+  // slot if they are behind. buffer gets back an empty batch of the same capacity
+  VOID publish(BranchEventBuffer &buffer) {
+    UINT64 position = head.position.load(std::memory_order_relaxed);
+    while (position - oldestUnconsumed() == slots.size()) {
+      PIN_Yield();
     }
+    BranchEventBuffer &slot = slots[position % slots.size()];
+    std::swap(slot.events, buffer.events);
+    slot.count = buffer.count;
+    buffer.count = 0;
+    head.position.store(position + 1, std::memory_order_release);
+  }
 
-    // instantiating the PHT
-    for (UINT64 i = 0; i < numEntries; i ++){
-      PHT.push_back(0b11);
+  // Producer: waits until every consumer is done with every published batch
+  VOID waitUntilConsumed() const {
+    while (oldestUnconsumed() != head.position.load(std::memory_order_relaxed)) {
+      PIN_Yield();
     }
   }
 
-  virtual bool getPrediction(ADDRINT branchPC) {
+  // Consumer: returns the next batch for this consumer, or NULL if none has been published yet
+  const BranchEventBuffer *peek(UINT32 consumer) const {
+    UINT64 position = tails[consumer].position.load(std::memory_order_relaxed);
+    if (position == head.position.load(std::memory_order_acquire)) {
+      return NULL;
+    }
+    return &slots[position % slots.size()];
+  }
 
-    // seven least significant bits
-    int LSB = 0b1111111 & branchPC;
+  // Consumer: marks the batch returned by peek() as done
+  VOID release(UINT32 consumer) {
+    UINT64 position = tails[consumer].position.load(std::memory_order_relaxed);
+    tails[consumer].position.store(position + 1, std::memory_order_release);
+  }
+};
 
-    // our index for PHT
-    int index = LHR[LSB] ; 
+static BranchBatchRing branchBatchRing;
 
-    // if the binary at address is 11 or 10
-    if (PHT.at(index) >= 0b10) { 
-      return true;
-    }
+/* Writes conditional branches to a compact binary trace file (-record_trace) */
+// The file starts with an 8 byte magic and a 32-bit version, followed by chunks.
+// Each chunk is a header of two 32-bit words (number of branches, payload bytes)
+// and a payload holding first the outcomes, one bit per branch (least significant
+// bit first), then every PC as the zigzag LEB128 varint of its difference to the
+// previous PC. The PC before the first branch of a chunk is 0, so each chunk can be
+// decoded on its own. Chunks are built in memory and written with one call each.
+//
+// Set with -record_trace. Threads append whole batches under traceWriterLock
+//
+static BranchTraceWriter *traceWriter = NULL;
+static PIN_LOCK traceWriterLock;
 
-    // else if the value in the PHT is 01 or 00
-    return false;
-  }
+// Simulator threads started with -sim_threads, and whether they are still consuming batches
+//
+static vector<PIN_THREAD_UID> simulatorThreadUids;
+static BOOL simulatorThreadsRunning = false;
+static std::atomic<BOOL> simulatorThreadsStopping(false);
 
-  virtual void train(ADDRINT branchPC, bool branchWasTaken) {
+// The predictors being simulated. There is a single one unless -sweep lists
+// several configurations, in which case all of them see the same branches.
+// In -thread_mode private these only accumulate the counters of finished threads
+//
+static PredictorSet globalPredictors;
+static PIN_LOCK predictorsLock;
+static BOOL sharedPredictors = false;
 
-    // seven least significant bits
-    int LSB = 0b1111111 & branchPC;
+// Application threads that have not been merged into globalPredictors yet
+//
+static vector<ThreadState *> threadStates;
+static PIN_LOCK threadStatesLock;
+static TLS_KEY threadStateKey;
+static REG threadStateReg;
 
-    // our index for PHT
-    int index = LHR[LSB] ;
+// Analysis routine inserted before every conditional branch, selected in main(), unless
+// branches are buffered (-batch_size) and recorded by RecordBufferedBranch() instead
+//
+AFUNPTR conditionalBranchRoutine;
+static BOOL bufferBranches = false;
 
-    if (branchWasTaken) {
+// The If and Then routines that count instructions, docount() and
+// CheckInstructionCount() or their -self_profile versions
+//
+static AFUNPTR countRoutine;
+static AFUNPTR checkRoutine;
 
-      // adjust the PHT
-      if (PHT.at(index) < 0b11){
-        PHT[index] ++ ;
-      }
+// Whether the tool times its own analysis routines (-self_profile), one in how many
+// calls of the branch routine is timed, the time stamp counter when main() started
+// and the profiles of the threads that have exited
+//
+static BOOL             selfProfile = false;
+static UINT32           selfProfilePeriod = 1;
+static UINT64           startCycles = 0;
+static SimulatorProfile simulatorProfile;
 
-      //shift left and add one to LHR
-      LHR[LSB] = ((index<<1) + 1) & PHTsize;
+// When main() started, for the wall time in the -output_format json and csv results
+//
+static std::chrono::steady_clock::time_point startTime;
 
-    }
-    else {
-      
-      // adjust the PHT
-      if (PHT.at(index) > 0b00){
-        PHT[index] -- ;
-      }
+// Sizes of the front-end models, and whether they are simulated at all (-front_end)
+//
+static FrontEndConfig frontEndConfig;
+static BOOL simulateFrontEnd = false;
 
-      //shift left and add zero to LHR
-      LHR[LSB] = (index<<1) & PHTsize;
-    }
-   }
+/* An image of the application, to attribute profiled branches to (-profile_branches) */
+//
+struct LoadedImage {
+  string name;
+  ADDRINT lowAddress;
+  ADDRINT highAddress;
 };
- 
-// GSHARE PREDICTOR                                                                                                                                          
-class GshareBranchPredictor : public BranchPredictorInterface {
 
-private:
+static vector<LoadedImage> loadedImages;
 
-  UINT64 numEntries;
+// Define the command line arguments that Pin should accept for this tool
+//
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "BP_stats.out", "specify output file name");
+KNOB<string> KnobOutputFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "output_format", "text", "format of the output file: text, json or csv (the last two hold the predictor counters only)");
+KNOB<UINT64> KnobStopInstructions(KNOB_MODE_WRITEONCE, "pintool",
+    "stop_at", "1000000000", "detach and print the counters when this number of instructions have been executed (0: run to the end)");
+KNOB<UINT64> KnobHeartbeatInstructions(KNOB_MODE_WRITEONCE, "pintool",
+    "heartbeat", "100000000", "print the instruction count every this many instructions (0: never)");
+KNOB<UINT64> KnobSkipInstructions(KNOB_MODE_WRITEONCE, "pintool",
+    "skip", "0", "train the predictors on the first this many instructions without counting them");
+KNOB<UINT64> KnobNumberOfEntriesInBranchPredictor(KNOB_MODE_WRITEONCE, "pintool",
+    "num_BP_entries", "1024", "specify number of entries in a branch predictor");
+KNOB<string> KnobBranchPredictorType(KNOB_MODE_WRITEONCE, "pintool",
+    "BP_type", "always_taken", "specify type of branch predictor to be used");
+KNOB<UINT64> KnobNumberOfLocalHistoryTableEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "num_LHT_entries", "128", "specify number of entries in the local history table");
+KNOB<UINT32> KnobLocalHistoryBits(KNOB_MODE_WRITEONCE, "pintool",
+    "local_history_bits", "0", "specify local history length in bits (0: log2 of num_BP_entries)");
+KNOB<UINT32> KnobGlobalHistoryBits(KNOB_MODE_WRITEONCE, "pintool",
+    "global_history_bits", "0", "specify global history length in bits (0: log2 of num_BP_entries, 200 for tage, 32 for perceptron)");
+KNOB<string> KnobHybridComponents(KNOB_MODE_WRITEONCE, "pintool",
+    "hybrid_components", "local+gshare", "predictor types combined by -BP_type hybrid, separated by +");
+KNOB<UINT32> KnobChooserHistoryBits(KNOB_MODE_WRITEONCE, "pintool",
+    "chooser_history_bits", "0", "global history bits XORed with the PC to index the hybrid chooser");
+KNOB<UINT32> KnobUpdateDelay(KNOB_MODE_WRITEONCE, "pintool",
+    "update_delay", "0", "branches between the prediction of a conditional branch and the update of the predictor with its outcome (0: update at once)");
+KNOB<string> KnobSweep(KNOB_MODE_WRITEONCE, "pintool",
+    "sweep", "", "simulate several predictors in one run: comma separated list of "
+    "type[:num_BP_entries[:num_LHT_entries[:local_history_bits[:global_history_bits[:update_delay]]]]], "
+    "omitted fields take the values of the corresponding options");
+KNOB<UINT32> KnobBatchSize(KNOB_MODE_WRITEONCE, "pintool",
+    "batch_size", "4096", "number of branches buffered before the predictors are run over them (0: simulate every branch immediately)");
+KNOB<string> KnobThreadMode(KNOB_MODE_WRITEONCE, "pintool",
+    "thread_mode", "private", "private: each application thread trains its own predictors and the counters are merged, "
+    "shared: all threads train the same predictors under a lock");
+KNOB<UINT32> KnobSimulatorThreads(KNOB_MODE_WRITEONCE, "pintool",
+    "sim_threads", "0", "number of internal threads that run the predictors while the application keeps executing (0: run them in the application thread, requires -batch_size and implies -thread_mode shared)");
+KNOB<string> KnobRecordTrace(KNOB_MODE_WRITEONCE, "pintool",
+    "record_trace", "", "write every conditional branch (PC and outcome) to this binary trace file (requires -batch_size)");
+KNOB<BOOL> KnobCountPerBasicBlock(KNOB_MODE_WRITEONCE, "pintool",
+    "count_per_bbl", "1", "count instructions once per basic block instead of once per instruction");
+KNOB<BOOL> KnobStaticPredictors(KNOB_MODE_WRITEONCE, "pintool",
+    "static_predictors", "1", "use predictors compiled for their table size when one exists "
+    "(local and gshare with 2^10 to 2^16 entries, default history lengths and LHT size)");
+KNOB<BOOL> KnobSweepKernel(KNOB_MODE_WRITEONCE, "pintool",
+    "sweep_kernel", "1", "simulate swept gshare configurations with the same num_BP_entries together, "
+    "several per instruction when built with AVX2 (requires -batch_size)");
+KNOB<BOOL> KnobFrontEnd(KNOB_MODE_WRITEONCE, "pintool",
+    "front_end", "0", "also simulate a BTB for the targets of taken branches, a return address stack and a loop predictor");
+KNOB<UINT64> KnobNumberOfBTBEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "btb_entries", "4096", "specify number of entries in the branch target buffer");
+KNOB<UINT32> KnobBTBWays(KNOB_MODE_WRITEONCE, "pintool",
+    "btb_ways", "4", "specify associativity of the branch target buffer");
+KNOB<UINT32> KnobNumberOfRASEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "ras_entries", "16", "specify number of entries in the return address stack");
+KNOB<UINT64> KnobNumberOfLoopEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "loop_entries", "256", "specify number of entries in the loop predictor");
+KNOB<UINT32> KnobProfileBranches(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_branches", "0", "count executions and mispredictions of every branch PC for the first predictor "
+    "and print this many of the most mispredicted ones (0: no profile)");
+KNOB<UINT64> KnobProfileEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "profile_entries", "65536", "number of distinct branch PCs the profile has room for");
+KNOB<string> KnobIntervals(KNOB_MODE_WRITEONCE, "pintool",
+    "intervals", "", "write the accuracy, MPKI and taken rate of every -interval_instrs instructions to this file");
+KNOB<UINT64> KnobIntervalInstructions(KNOB_MODE_WRITEONCE, "pintool",
+    "interval_instrs", "100000000", "length of the intervals written to -intervals");
+KNOB<string> KnobIntervalFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "interval_format", "csv", "format of -intervals: csv or json");
+KNOB<string> KnobSaveState(KNOB_MODE_WRITEONCE, "pintool",
+    "save_state", "", "write the state of all predictors to this file when -save_state_at instructions have been executed");
+KNOB<UINT64> KnobSaveStateAt(KNOB_MODE_WRITEONCE, "pintool",
+    "save_state_at", "0", "instruction count at which -save_state is written (0: when the simulation stops)");
+KNOB<string> KnobLoadState(KNOB_MODE_WRITEONCE, "pintool",
+    "load_state", "", "start all predictors from the state saved in this file with -save_state by a run with the same options");
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_period", "0", "only simulate the branches of one -sample_window instructions long window every this many "
+    "instructions and estimate the accuracy of the whole run from them (0: simulate every branch, implies -thread_mode shared)");
+KNOB<UINT64> KnobSampleWindow(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_window", "10000000", "length of the detailed windows of -sample_period");
+KNOB<BOOL> KnobSelfProfile(KNOB_MODE_WRITEONCE, "pintool",
+    "self_profile", "0", "count the cycles spent in the analysis routines and the predictors and report them per branch");
+KNOB<UINT32> KnobSelfProfilePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "self_profile_period", "256", "time one in this many calls of the branch analysis routine with -self_profile");
+
+// The running count of instructions of all threads is kept here, the counts
+// of branches and predictions are kept in globalPredictors
+//
+static std::atomic<UINT64> iCount(0);
 
-public:
+VOID StopSimulatorThreads();
 
-  int PHTsize;
-  int GHR = 0;
-  vector<int> PHT;
+// Instruction counts at which Pin detaches (-stop_at), at which the next heartbeat is
+// printed (-heartbeat) and at which the counting starts (-skip), or NO_INSTR_NUM.
+// When counting per basic block iCount advances in steps of several instructions,
+// so these are compared with >= rather than checked for an exact hit
+//
+static const UINT64        NO_INSTR_NUM = ~0ULL;
+static UINT64              stopInstrNum = NO_INSTR_NUM;
+static UINT64              heartbeatInterval = 0;
+static std::atomic<UINT64> nextHeartbeatInstrNum(NO_INSTR_NUM);
+static std::atomic<BOOL>   detachRequested(false);
+static UINT64              skipInstrNum = NO_INSTR_NUM;
+static std::atomic<BOOL>   skipDone(false);
+
+// iCount when the counters started, subtracted from the instructions in the report
+//
+static UINT64 countedFromInstrNum = 0;
 
-  GshareBranchPredictor(UINT64 numberOfEntries) {
-    numEntries = numberOfEntries;
+// Instruction count at which the predictor state is saved (-save_state), 0 if it is not.
+// saveStateAtEnd is set when it is saved as the simulation ends (-save_state_at 0).
+// The snapshot read with -load_state, loaded into every new set of predictors
+//
+static UINT64            saveStateInstrNum = 0;
+static BOOL              saveStateAtEnd = false;
+static std::atomic<BOOL> stateSaved(false);
+static string            loadedPredictorState;
+
+// Length of the intervals of -intervals, 0 if they are not recorded. With shared
+// predictors an interval ends every intervalLength instructions of iCount, with
+// private ones every intervalLength instructions of each thread
+//
+static UINT64             intervalLength = 0;
+static std::atomic<UINT64> nextIntervalInstrNum(0);
 
-    // for shifting the LHR                                                                                                                         
-    if (numEntries == 4096){
-      PHTsize = 0b111111111111;
+// Period and length of the detailed windows of -sample_period, 0 if every branch is
+// simulated. Between the windows only instructions are counted. The instruction count
+// at which the tool next switches between the two modes, and where the window started
+//
+static UINT64              samplePeriod = 0;
+static UINT64              sampleWindow = 0;
+static std::atomic<UINT64> nextSampleSwitchInstrNum(NO_INSTR_NUM);
+static std::atomic<BOOL>   sampleDetailed(true);
+static UINT64              sampleWindowStart = 0;
+
+VOID SavePredictorState(ThreadState *ts, UINT64 total);
+VOID WritePredictorState(PredictorSet &set, UINT64 total);
+VOID RecordInterval(ThreadState *ts, UINT64 instructions);
+VOID EndSkip(ThreadState *ts, UINT64 instructions);
+VOID SwitchSampleMode(ThreadState *ts, UINT64 instructions);
+
+// Adds the instructions the thread executed since its last check to iCount, prints
+// the heartbeat and detaches at -stop_at. The next check of the thread is due
+// no later than the next heartbeat or the stop point, so a single thread reaches
+// them at exactly the same instruction as if it updated iCount itself
+//
+VOID CheckInstructionCount(ThreadState *ts) {
+  UINT64 newInstructions = ts->iCount - ts->reportedICount;
+  UINT64 total = iCount.fetch_add(newInstructions) + newInstructions;
+  ts->reportedICount = ts->iCount;
+
+  // Print this message every -heartbeat instructions executed
+  UINT64 heartbeat = nextHeartbeatInstrNum.load();
+  while (total >= heartbeat) {
+    if (nextHeartbeatInstrNum.compare_exchange_weak(heartbeat, heartbeat + heartbeatInterval)) {
+      std::cerr << "Executed " << total << " instructions." << endl;
+      heartbeat += heartbeatInterval;
     }
-    if (numEntries == 1024){
-      PHTsize = 0b1111111111;
+  }
+  if (intervalLength && sharedPredictors) {
+    UINT64 intervalEnd = nextIntervalInstrNum.load();
+    while (total >= intervalEnd) {
+      if (nextIntervalInstrNum.compare_exchange_weak(intervalEnd, intervalEnd + intervalLength)) {
+        RecordInterval(ts, intervalEnd);
+        intervalEnd += intervalLength;
+      }
     }
-    if (numEntries == 128){
-      PHTsize = 0b1111111;
+  }
+  else if (intervalLength) {
+    while (ts->iCount >= ts->nextIntervalEnd) {
+      RecordInterval(ts, ts->nextIntervalEnd);
+      ts->nextIntervalEnd += intervalLength;
     }
-
-    for (UINT64 i = 0; i < numEntries; i ++){
-      PHT.push_back(0b11);
+  }
+  // Start counting once -skip instructions have been executed. Threads with private
+  // predictors each clear their own counters when they get here afterwards
+  if (total >= skipInstrNum && !skipDone.exchange(true)) {
+    EndSkip(ts, sharedPredictors ? skipInstrNum : ts->iCount);
+  }
+  else if (skipDone.load() && !ts->countersReset && !sharedPredictors) {
+    EndSkip(ts, ts->iCount);
+  }
+  // Start or end a detailed window of -sample_period
+  UINT64 sampleSwitch = nextSampleSwitchInstrNum.load();
+  while (total >= sampleSwitch) {
+    if (nextSampleSwitchInstrNum.compare_exchange_weak(sampleSwitch, NO_INSTR_NUM)) {
+      SwitchSampleMode(ts, sampleSwitch);
+      sampleSwitch = nextSampleSwitchInstrNum.load();
     }
   }
+  if (saveStateInstrNum && total >= saveStateInstrNum && !stateSaved.exchange(true)) {
+    SavePredictorState(ts, total);
+  }
+  // Release control of application if -stop_at instructions have been executed
+  if (total >= stopInstrNum && !detachRequested.exchange(true)) {
+    // let the simulator threads catch up now, branches executed until Pin has
+    // actually detached are simulated in the application threads
+    StopSimulatorThreads();
+    PIN_Detach();
+  }
 
-  virtual bool getPrediction(ADDRINT branchPC) {
-
-    // n least significant bits                                                                                                                 
-    int LSB = PHTsize & branchPC;
+  UINT64 nextEvent = heartbeat < stopInstrNum ? heartbeat : stopInstrNum;
+  if (skipInstrNum > total && skipInstrNum < nextEvent) {
+    nextEvent = skipInstrNum;
+  }
+  if (saveStateInstrNum > total && saveStateInstrNum < nextEvent) {
+    nextEvent = saveStateInstrNum;
+  }
+  if (nextSampleSwitchInstrNum.load() < nextEvent) {
+    nextEvent = nextSampleSwitchInstrNum.load();
+  }
+  if (intervalLength && sharedPredictors && nextIntervalInstrNum.load() < nextEvent) {
+    nextEvent = nextIntervalInstrNum.load();
+  }
+  UINT64 untilNextCheck = INSTRUCTION_CHECK_INTERVAL;
+  if (nextEvent > total && nextEvent - total < untilNextCheck) {
+    untilNextCheck = nextEvent - total;
+  }
+  if (intervalLength && !sharedPredictors && ts->nextIntervalEnd - ts->iCount < untilNextCheck) {
+    untilNextCheck = ts->nextIntervalEnd - ts->iCount;
+  }
+  ts->nextInstructionCheck = ts->iCount + untilNextCheck;
+}
 
-    // our index for PHT                                                                                                                            
-    int index = LSB ^ GHR ;
+// Counts the instructions of a block or a single instruction. This is the If part of
+// an if/then call, small enough for Pin to inline; CheckInstructionCount() is the
+// Then part and only runs when the next check is due
+//
+ADDRINT docount(ThreadState *ts, UINT32 numInstructions) {
+  ts->iCount += numInstructions;
+  return ts->iCount >= ts->nextInstructionCheck;
+}
 
-    // if the binary at address is 11 or 10                                                                                                         
-    if (PHT.at(index) >= 0b10) {
-      return true;
-    }
 
-    // else if the value in the PHT is 01 or 00                                                                                                     
-    return false;
-  }
 
-virtual void train(ADDRINT branchPC, bool branchWasTaken) {
+VOID RetireThreadState(ThreadState *ts);
 
-    // n least significant bits                                                                                                                  
-    int LSB = PHTsize & branchPC;
+// Pin calls this function when an image is loaded (-profile_branches). Its address
+// range is kept so that profiled branches can be attributed to it at the end, when
+// the application may have unloaded it already
+//
+VOID ImageLoad(IMG img, VOID *v) {
+  LoadedImage image = {IMG_Name(img), IMG_LowAddress(img), IMG_HighAddress(img)};
+  loadedImages.push_back(image);
+}
 
-    // our index for PHT                                                                                                                             
-    int index = LSB ^ GHR ;
+// Prints the count most mispredicted branches of profile, with the image and
+// offset of every PC and the name of its routine if Pin knows it
+//
+VOID WriteBranchProfile(ostream &out, const BranchProfile &profile, UINT32 count) {
+  vector<BranchProfile::Entry> branches = profile.top(count);
+
+  out << endl
+      << "Most mispredicted branches of " << globalPredictors.predictors[0].config.type << ":" << endl
+      << "PC	Executions	Mispredictions	Misprediction rate	Taken rate	Image	Offset	Routine" << endl;
+  PIN_LockClient();
+  for (UINT32 i = 0; i < branches.size(); i++) {
+    const BranchProfile::Entry &branch = branches[i];
+    string imageName = "?";
+    ADDRINT offset = branch.pc;
+    for (UINT32 j = 0; j < loadedImages.size(); j++) {
+      if (branch.pc >= loadedImages[j].lowAddress && branch.pc <= loadedImages[j].highAddress) {
+        imageName = loadedImages[j].name;
+        offset = branch.pc - loadedImages[j].lowAddress;
+      }
+    }
+    string routine = RTN_FindNameByAddress(branch.pc);
+
+    out << std::hex << branch.pc << std::dec                           << "\t"
+        << branch.executions                                           << "\t"
+        << branch.mispredictions                                       << "\t"
+        << (double)branch.mispredictions / (double)branch.executions << "\t"
+        << (double)branch.taken / (double)branch.executions          << "\t"
+        << imageName                                                   << "\t"
+        << std::hex << offset << std::dec                              << "\t"
+        << (routine.empty() ? "?" : routine)                           << endl;
+  }
+  PIN_UnlockClient();
+  if (profile.untracked()) {
+    out << "Branches executed after the profile was full:\t" << profile.untracked() << endl;
+  }
+}
 
-    if (branchWasTaken) {
+// Prints the cycles of the analysis routines and of every predictor for -self_profile.
+// The rows of the routines do not overlap, what is left of the cycles since main()
+// went to Pin, the application and the routines that are not timed. With several
+// threads the routines of all of them are added up, so the shares can exceed 1
+//
+VOID WriteSimulatorProfile(ostream &out, const SimulatorProfile &profile, const PredictorSet &set, UINT64 totalCycles) {
+  struct Row {
+    const char *name;
+    const ProfiledRegion &region;
+  };
+  const Row rows[] = {
+    {"Branch analysis routine",  profile.branchRoutine},
+    {"Buffer flushes",           profile.bufferFlushes},
+    {"Instruction count checks", profile.countChecks},
+  };
+  double branches = (double)set.stream.conditionalBranchesCount;
+  double timedCycles = 0.0;
+
+  out << endl
+      << "Cycles since the tool started:\t" << totalCycles            << endl
+      << "Cycles per conditional branch:\t" << totalCycles / branches << endl
+      << "Instruction count calls:\t"       << profile.countCalls     << endl
+      << endl
+      << "Routine\tCalls\tTimed calls\tCycles per call\tEstimated cycles\tCycles per branch\tShare of the run" << endl;
+  for (UINT32 i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+    const ProfiledRegion &region = rows[i].region;
+    double cycles = region.estimatedCycles();
+    timedCycles += cycles;
+    out << rows[i].name                                                          << "\t"
+        << region.calls                                                          << "\t"
+        << region.timedCalls                                                     << "\t"
+        << (region.timedCalls ? (double)region.cycles / region.timedCalls : 0.0) << "\t"
+        << cycles                                                                << "\t"
+        << cycles / branches                                                     << "\t"
+        << cycles / totalCycles                                                  << endl;
+  }
+  out << "Pin, application and untimed routines\t-\t-\t-\t"
+      << totalCycles - timedCycles << "\t" << (totalCycles - timedCycles) / branches << "\t" << 1.0 - timedCycles / totalCycles << endl;
 
-      // adjust the PHT                                                                                                                              
-      if (PHT.at(index) < 0b11){
-        PHT[index] ++ ;
-      }
+  // batches only, the unbuffered routines predict inside the branch analysis routine
+  if (!bufferBranches) {
+    return;
+  }
+  out << endl
+      << "BP_type\tnum_BP_entries\tCycles in batches\tCycles per branch" << endl;
+  for (UINT32 i = 0; i < set.predictors.size(); i++) {
+    const SimulatedPredictor &sim = set.predictors[i];
+    out << sim.config.type                         << "\t"
+        << sim.config.numEntries                   << "\t"
+        << sim.simulationCycles                    << "\t"
+        << (double)sim.simulationCycles / branches << endl;
+  }
+}
 
-      //shift left and add one to LHR                                                                                                                
-      GHR = ((index<<1) + 1) & PHTsize;
+// Rows to reserve for the interval series of a set of predictors
+//
+UINT64 ExpectedIntervalRows() {
+  // one more for the last, partial interval and one for the end of -skip
+  return stopInstrNum == NO_INSTR_NUM ? UNBOUNDED_INTERVAL_ROWS : stopInstrNum / intervalLength + 2;
+}
 
-    }
-    else {
+// Writes the interval series of the global predictors to -intervals
+//
+VOID WriteIntervals() {
+  ofstream file(KnobIntervals.Value().c_str());
+  if (KnobIntervalFormat.Value() == "json") {
+    globalPredictors.intervals.writeJSON(file, globalPredictors.predictors);
+  }
+  else {
+    globalPredictors.intervals.writeCSV(file, globalPredictors.predictors);
+  }
+  if (!file) {
+    std::cerr << "Warning: Could not write " << KnobIntervals.Value() << "." << endl;
+  }
+}
 
-      // adjust the PHT                                                                                                                              
-      if (PHT.at(index) > 0b00){
-        PHT[index] -- ;
-      }
+// The options that shape the results, written with -output_format json and csv
+//
+template <class T>
+static string KnobValueString(const KNOB<T> &knob) {
+  ostringstream value;
+  value << knob.Value();
+  return value.str();
+}
 
-      //shift left and add zero to LHR                                                                                                               
-      GHR = (index<<1) & PHTsize;
-    }
-   }
-};
+BranchResultOptions CollectResultOptions() {
+  BranchResultOptions options;
+  options.push_back(make_pair(string("sweep"),             KnobSweep.Value()));
+  options.push_back(make_pair(string("thread_mode"),       sharedPredictors ? string("shared") : string("private")));
+  options.push_back(make_pair(string("batch_size"),        KnobValueString(KnobBatchSize)));
+  options.push_back(make_pair(string("sim_threads"),       KnobValueString(KnobSimulatorThreads)));
+  options.push_back(make_pair(string("static_predictors"), KnobValueString(KnobStaticPredictors)));
+  options.push_back(make_pair(string("sweep_kernel"),      KnobValueString(KnobSweepKernel)));
+  options.push_back(make_pair(string("count_per_bbl"),     KnobValueString(KnobCountPerBasicBlock)));
+  options.push_back(make_pair(string("stop_at"),           KnobValueString(KnobStopInstructions)));
+  options.push_back(make_pair(string("skip"),              KnobValueString(KnobSkipInstructions)));
+  options.push_back(make_pair(string("sample_period"),     KnobValueString(KnobSamplePeriod)));
+  options.push_back(make_pair(string("sample_window"),     KnobValueString(KnobSampleWindow)));
+  options.push_back(make_pair(string("load_state"),        KnobLoadState.Value()));
+  return options;
+}
 
+VOID TerminateSimulationHandler(VOID *v) {
+  // Branches still waiting in the buffers have to be simulated before printing the counters
+  StopSimulatorThreads();
+  while (!threadStates.empty()) {
+    RetireThreadState(threadStates.back());
+  }
+  if (saveStateAtEnd && sharedPredictors) {
+    WritePredictorState(globalPredictors, iCount.load());
+  }
 
-// TOURNAMENT PREDICTOR
-class TournamentBranchPredictor : public BranchPredictorInterface {
- 
-private:
-  
-  UINT64 numEntries;
- 
-public:
-  BranchPredictorInterface *gbranch;
-  BranchPredictorInterface *lbranch;
-  int PHTsize;
-  // 1 is local 0 is gshare
-  int used = 2;
-  vector<int> PHT;
+  const vector<SimulatedPredictor> &simulatedPredictors = globalPredictors.predictors;
+  UINT64 conditionalBranchesCount = globalPredictors.stream.conditionalBranchesCount;
 
-  TournamentBranchPredictor(UINT64 numberOfEntries) {
-    numEntries = numberOfEntries;
+  if (intervalLength) {
+    // the last interval ends here, whatever its length
+    if (sharedPredictors) {
+      globalPredictors.intervals.record(iCount.load(), globalPredictors.stream, simulatedPredictors);
+    }
+    WriteIntervals();
+  }
+  if (samplePeriod && sampleDetailed.load()) {
+    // the last window ends here, whatever its length
+    globalPredictors.samples.record(iCount.load(), globalPredictors.stream, simulatedPredictors);
+  }
 
-    // for shifting the LHR 
-    if (numEntries == 4096){
-      PHTsize = 0b111111111111;
+  // At the end of a simulation, print counters to a file. When sampling they only
+  // cover the windows, so they are not divided by the instructions of the whole run.
+  // The report is put together in memory and written to the file in one go
+  ostringstream report;
+  UINT64 countedInstructions = samplePeriod ? 0 : iCount.load() - countedFromInstrNum;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  if (KnobOutputFormat.Value() == "json") {
+    WriteBranchPredictorResultsJSON(report, globalPredictors.stream, simulatedPredictors, countedInstructions, seconds, CollectResultOptions());
+  }
+  else if (KnobOutputFormat.Value() == "csv") {
+    WriteBranchPredictorResultsCSV(report, globalPredictors.stream, simulatedPredictors, countedInstructions, seconds, CollectResultOptions());
+  }
+  else {
+    WriteBranchPredictorReport(report, globalPredictors.stream, simulatedPredictors, countedInstructions);
+    if (samplePeriod) {
+      globalPredictors.samples.writeEstimate(report, simulatedPredictors, iCount.load() - countedFromInstrNum);
     }
-    if (numEntries == 1024){
-      PHTsize = 0b1111111111;
+    if (globalPredictors.frontEnd) {
+      WriteFrontEndReport(report, frontEndConfig, globalPredictors.frontEnd->stats);
     }
-    if (numEntries == 128){
-      PHTsize = 0b1111111;
+    if (simulatedPredictors[0].profile) {
+      WriteBranchProfile(report, *simulatedPredictors[0].profile, KnobProfileBranches.Value());
     }
-
-    for (UINT64 i = 0; i < numEntries; i ++){
-      PHT.push_back(0b11);
+    if (selfProfile) {
+      WriteSimulatorProfile(report, simulatorProfile, globalPredictors, __rdtsc() - startCycles);
     }
-
-    lbranch = new LocalBranchPredictor(numEntries);
-    gbranch = new GshareBranchPredictor(numEntries);
+  }
+  OutFile << report.str();
+  OutFile.close();
+  if (!OutFile) {
+    std::cerr << "Warning: Could not write " << KnobOutputFile.Value() << "." << endl;
   }
 
-  virtual bool getPrediction(ADDRINT branchPC) {
+  if (traceWriter) {
+    traceWriter->close();
+  }
 
-    // least significant bits
-    int LSB = PHTsize & branchPC;
+  if (skipInstrNum != NO_INSTR_NUM && !skipDone.load()) {
+    std::cerr << "Warning: The simulation ended during -skip, the counters include the warm-up." << endl;
+  }
+  if (saveStateInstrNum && !stateSaved.load()) {
+    std::cerr << "Warning: The simulation ended before -save_state_at, no predictor state was saved." << endl;
+  }
 
-    // if the binary at address is 11 or 10 take the gshare prediction
-    if (PHT.at(LSB) >= 0b10) { 
-      used = 0;
-      return gbranch -> getPrediction(branchPC);
+  std::cerr << endl << "PIN has been detached at iCount = " << iCount.load() << endl;
+  std::cerr << endl << "Simulation has reached its target point. Terminate simulation." << endl;
+  for (UINT32 i = 0; i < simulatedPredictors.size(); i++) {
+    const SimulatedPredictor &sim = simulatedPredictors[i];
+    if (simulatedPredictors.size() > 1) {
+      std::cerr << sim.config.type << " " << sim.config.numEntries << ":\t";
     }
+    std::cerr << "Prediction accuracy:\t" << (double)sim.stats.correctPredictionCount / (double)conditionalBranchesCount << endl;
+  }
+  std::exit(EXIT_SUCCESS);
+}
+
+//
+VOID Fini(int code, VOID * v)
+{
+  TerminateSimulationHandler(v);
+}
 
-    // else if the value in the PHT is 01 or 00 take the local predictor
-    used = 1;
-    return lbranch -> getPrediction(branchPC);
+// Internal threads have to be stopped before the application exits, while they
+// can still run: drain them here so that Fini() finds their counters complete
+//
+VOID PrepareForFini(VOID *v)
+{
+  StopSimulatorThreads();
+}
+
+// Locking around the predictors of a thread, only needed when they are shared
+//
+static inline VOID LockPredictors(ThreadState *ts) {
+  if (ts->predictorsLock) {
+    PIN_GetLock(ts->predictorsLock, ts->tid + 1);
   }
+}
 
-  virtual void train(ADDRINT branchPC, bool branchWasTaken) {
+static inline VOID UnlockPredictors(ThreadState *ts) {
+  if (ts->predictorsLock) {
+    PIN_ReleaseLock(ts->predictorsLock);
+  }
+}
 
-    bool gresult = gbranch -> getPrediction(branchPC);
-    bool lresult = lbranch -> getPrediction(branchPC);
+// This function is called before every conditional branch is executed.
+// It is instantiated once per predictor class so that the prediction and the
+// training are direct calls that the compiler can inline into one function.
+//
+template <class Predictor>
+static VOID AtConditionalBranch(ThreadState *ts, ADDRINT branchPC, BOOL branchWasTaken) {
+  /*
+	 * This is the place where the predictor is queried for a prediction and trained
+	 */
+  LockPredictors(ts);
+  PredictorSet &set = *ts->predictors;
+  SimulatedPredictor &sim = set.predictors[0];
+  Predictor *predictor = static_cast<Predictor *>(sim.predictor);
 
-    // least significant bits
-    int LSB = PHTsize & branchPC;
+  // Make a prediction for the current branch PC and train the predictor
+  // with the actual branch outcome in the same pass
+  //
+	bool wasPredictedTaken = predictor->Predictor::predictAndTrain(branchPC, branchWasTaken);
 
-    // Training when the branch was taken
-    if (branchWasTaken) {
+  sim.stats.record(wasPredictedTaken, branchWasTaken);
+  if (sim.profile) {
+    sim.profile->record(branchPC, wasPredictedTaken, branchWasTaken);
+  }
 
-      // train both local and gshare
-      gbranch -> train(branchPC, true);
-      lbranch -> train(branchPC, true);
+  set.stream.record(branchWasTaken);
+  UnlockPredictors(ts);
+}
 
-      if (used == 0){
-        if (! gresult && lresult){
-          // Strengthen the PHT
-          if (PHT.at(LSB) > 0b00){
-            PHT[LSB] -- ;
-        }
-        }
-        else if (gresult && PHT.at(LSB) < 0b11) {
-            PHT[LSB] ++ ;
-        }
-        }
-        
-      else if (used == 1){
-        if (gresult && ! lresult){
-          // Strengthen the PHT
-          if (PHT.at(LSB) < 0b11){
-            PHT[LSB] ++ ;
-        }
-        }
-        else if (lresult && PHT.at(LSB) > 0b00){
-            PHT[LSB] -- ;
+// Runs one predictor over a batch of branches. It is instantiated once per predictor
+// class, like AtConditionalBranch<>, and keeps the counters in locals for the whole batch
+//
+template <class Predictor>
+static VOID SimulateBranchBatch(SimulatedPredictor &sim, const BranchEvent *events, UINT32 numEvents) {
+  if (sim.profile) {
+    SimulateBranches(*static_cast<Predictor *>(sim.predictor), events, numEvents, sim.stats, *sim.profile);
+    return;
+  }
+  SimulateBranches(*static_cast<Predictor *>(sim.predictor), events, numEvents, sim.stats);
+}
+
+// Runs all lanes of a gshare group over a batch of branches and adds their
+// counters to the predictors they stand for
+//
+static VOID SimulateGshareSweepGroup(PredictorSet &set, GshareSweepGroup &group, const BranchEvent *events, UINT32 numEvents) {
+  std::fill(group.laneStats.begin(), group.laneStats.end(), BranchPredictorStats());
+  group.kernel->simulate(events, numEvents, group.laneStats.data());
+  for (UINT32 k = 0; k < group.members.size(); k++) {
+    set.predictors[group.members[k]].stats.merge(group.laneStats[k]);
+  }
+}
+
+// Runs the predictors numbered first, first + stride, ... over a batch of branches.
+// The gshare groups are numbered after the predictors and dealt out the same way.
+// The one that runs predictor 0 also counts the branches of the stream
+//
+static VOID SimulateBatch(PredictorSet &set, const BranchEvent *events, UINT32 numEvents, UINT32 first, UINT32 stride) {
+  UINT32 numPredictors = set.predictors.size();
+  for (UINT32 i = first; i < numPredictors + set.gshareGroups.size(); i += stride) {
+    if (i >= numPredictors) {
+      GshareSweepGroup &group = set.gshareGroups[i - numPredictors];
+      UINT64 start = selfProfile ? __rdtsc() : 0;
+      SimulateGshareSweepGroup(set, group, events, numEvents);
+      if (selfProfile) {
+        // the lanes share the cost of the kernel
+        UINT64 cycles = (__rdtsc() - start) / group.members.size();
+        for (UINT32 k = 0; k < group.members.size(); k++) {
+          set.predictors[group.members[k]].simulationCycles += cycles;
         }
       }
+      continue;
+    }
+    SimulatedPredictor &sim = set.predictors[i];
+    if (sim.simulateBatch && selfProfile) {
+      UINT64 start = __rdtsc();
+      sim.simulateBatch(sim, events, numEvents);
+      sim.simulationCycles += __rdtsc() - start;
     }
+    else if (sim.simulateBatch) {
+      sim.simulateBatch(sim, events, numEvents);
+    }
+  }
 
-    // if the branhc was not taken
-    if (! branchWasTaken) {
-      
-      // train both local and gshare
-      gbranch -> train(branchPC, false);
-      lbranch -> train(branchPC, false);
+  if (first == 0) {
+    for (UINT32 i = 0; i < numEvents; i++) {
+      set.stream.record(events[i].taken);
+    }
+  }
+}
 
-      if (used == 0){
-        if ( gresult && ! lresult){
-          // Strengthen the PHT
-          if (PHT.at(LSB) > 0b00){
-            PHT[LSB] -- ;
-        }
-        }
-        else if (! gresult && PHT.at(LSB) < 0b11){
-            PHT[LSB] ++ ;
-        }
+// Body of simulator thread number consumer (of -sim_threads). It runs its share of
+// the predictors over every published batch until StopSimulatorThreads() is called
+// and nothing is left in the ring
+//
+static VOID SimulatorThread(VOID *arg) {
+  UINT32 consumer = (UINT32)(ADDRINT)arg;
+  UINT32 numConsumers = simulatorThreadUids.size();
+
+  for (;;) {
+    const BranchEventBuffer *batch = branchBatchRing.peek(consumer);
+    if (batch == NULL) {
+      // re-check after seeing the stop flag, the last batch may have been published just before it
+      if (simulatorThreadsStopping.load(std::memory_order_acquire) && branchBatchRing.peek(consumer) == NULL) {
+        return;
       }
-        
-      else if (used == 1){
-          if (! gresult && lresult){
-          // Strengthen the PHT
-          if (PHT.at(LSB) < 0b11){
-            PHT[LSB] ++ ;
-        }
-        }
-        else if (! lresult && PHT.at(LSB) > 0b00){
-            PHT[LSB] -- ;
-        }
+      PIN_Yield();
+      continue;
     }
-   }
+    SimulateBatch(globalPredictors, batch->events.data(), batch->count, consumer, numConsumers);
+    branchBatchRing.release(consumer);
   }
-};
+}
 
-//##############################################################################
-//------------------------------------------------------------------------------
+VOID StartSimulatorThreads(UINT32 numThreads, UINT32 batchSize) {
+  branchBatchRing.init(SIMULATOR_RING_BATCHES, batchSize, numThreads);
+  simulatorThreadUids.resize(numThreads);
+  for (UINT32 i = 0; i < numThreads; i++) {
+    if (PIN_SpawnInternalThread(SimulatorThread, (VOID *)(ADDRINT)i, 0, &simulatorThreadUids[i]) == INVALID_THREADID) {
+      std::cerr << "Error: Could not start simulator thread. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+  simulatorThreadsRunning = true;
+}
 
-ofstream OutFile;
-BranchPredictorInterface *branchPredictor;
+// Waits until the simulator threads have simulated every published batch and stops
+// them. Afterwards branches are simulated in the application threads. Publishing is
+// done under predictorsLock, so holding it here means no batch can be left behind
+//
+VOID StopSimulatorThreads() {
+  PIN_GetLock(&predictorsLock, -1);
+  if (simulatorThreadsRunning) {
+    simulatorThreadsStopping.store(true, std::memory_order_release);
+    for (UINT32 i = 0; i < simulatorThreadUids.size(); i++) {
+      PIN_WaitForThreadTermination(simulatorThreadUids[i], PIN_INFINITE_TIMEOUT, NULL);
+    }
+    simulatorThreadsRunning = false;
+  }
+  PIN_ReleaseLock(&predictorsLock);
+}
 
-// Define the command line arguments that Pin should accept for this tool
+// Runs every predictor of the thread over the branches collected in its buffer and
+// empties it. While simulator threads are running the batch is passed to them instead
 //
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
-    "o", "BP_stats.out", "specify output file name");
-KNOB<UINT64> KnobNumberOfEntriesInBranchPredictor(KNOB_MODE_WRITEONCE, "pintool",
-    "num_BP_entries", "1024", "specify number of entries in a branch predictor");
-KNOB<string> KnobBranchPredictorType(KNOB_MODE_WRITEONCE, "pintool",
-    "BP_type", "always_taken", "specify type of branch predictor to be used");
+VOID SimulateBufferedBranches(ThreadState *ts) {
+  if (traceWriter) {
+    PIN_GetLock(&traceWriterLock, ts->tid + 1);
+    traceWriter->append(ts->buffer.events.data(), ts->buffer.count);
+    PIN_ReleaseLock(&traceWriterLock);
+  }
 
-// The running counts of branches, predictions and instructions are kept here
-//
-static UINT64 iCount                          = 0;
-static UINT64 correctPredictionCount          = 0;
-static UINT64 conditionalBranchesCount        = 0;
-static UINT64 takenBranchesCount              = 0;
-static UINT64 notTakenBranchesCount           = 0;
-static UINT64 predictedTakenBranchesCount     = 0;
-static UINT64 predictedNotTakenBranchesCount  = 0;
-
-VOID docount() {
-  // Update instruction counter
-  iCount++;
-  // Print this message every SIMULATOR_HEARTBEAT_INSTR_NUM executed
-  if (iCount % SIMULATOR_HEARTBEAT_INSTR_NUM == 0) {
-    std::cerr << "Executed " << iCount << " instructions." << endl;
-  }
-  // Release control of application if STOP_INSTR_NUM instructions have been executed
-  if (iCount == STOP_INSTR_NUM) {
-    PIN_Detach();
+  LockPredictors(ts);
+  if (simulatorThreadsRunning) {
+    branchBatchRing.publish(ts->buffer);
   }
+  else {
+    SimulateBatch(*ts->predictors, ts->buffer.events.data(), ts->buffer.count, 0, 1);
+    ts->buffer.count = 0;
+  }
+  UnlockPredictors(ts);
 }
 
+// Records every conditional branch when branches are buffered (-batch_size). Like
+// docount() this is the inlined If part, and SimulateBufferedBranches() runs as the
+// Then part when it reports that the buffer is full
+//
+static ADDRINT RecordBufferedBranch(ThreadState *ts, ADDRINT branchPC, BOOL branchWasTaken) {
+  BranchEventBuffer &buffer = ts->buffer;
+  BranchEvent &event = buffer.events[buffer.count];
+  event.pc = branchPC;
+  event.taken = branchWasTaken;
+  return ++buffer.count == buffer.events.size();
+}
 
+// The analysis routines of -self_profile. They stand in for docount(),
+// CheckInstructionCount(), SimulateBufferedBranches() and conditionalBranchRoutine
+// and time them with the time stamp counter: the rare ones at every call, the
+// branch routine at one call in -self_profile_period
+//
+static ADDRINT docountProfiled(ThreadState *ts, UINT32 numInstructions) {
+  ts->profile.countCalls++;
+  ts->iCount += numInstructions;
+  return ts->iCount >= ts->nextInstructionCheck;
+}
 
-VOID TerminateSimulationHandler(VOID *v) {
-  OutFile.setf(ios::showbase);
-  // At the end of a simulation, print counters to a file
-  OutFile << "Prediction accuracy:\t"            << (double)correctPredictionCount / (double)conditionalBranchesCount << endl
-          << "Number of conditional branches:\t" << conditionalBranchesCount                                      << endl
-          << "Number of correct predictions:\t"  << correctPredictionCount                                        << endl
-          << "Number of taken branches:\t"       << takenBranchesCount                                            << endl
-          << "Number of non-taken branches:\t"   << notTakenBranchesCount                                         << endl
-          ;
-  OutFile.close();
+static VOID CheckInstructionCountProfiled(ThreadState *ts) {
+  UINT64 start = __rdtsc();
+  CheckInstructionCount(ts);
+  ts->profile.countChecks.calls++;
+  ts->profile.countChecks.record(__rdtsc() - start);
+}
 
-  std::cerr << endl << "PIN has been detached at iCount = " << STOP_INSTR_NUM << endl;
-  std::cerr << endl << "Simulation has reached its target point. Terminate simulation." << endl;
-  std::cerr << "Prediction accuracy:\t" << (double)correctPredictionCount / (double)conditionalBranchesCount << endl;
-  std::exit(EXIT_SUCCESS);
+static VOID SimulateBufferedBranchesProfiled(ThreadState *ts) {
+  UINT64 start = __rdtsc();
+  SimulateBufferedBranches(ts);
+  ts->profile.bufferFlushes.calls++;
+  ts->profile.bufferFlushes.record(__rdtsc() - start);
 }
 
-//
-VOID Fini(int code, VOID * v)
-{
-  TerminateSimulationHandler(v);
+static VOID AtConditionalBranchProfiled(ThreadState *ts, ADDRINT branchPC, BOOL branchWasTaken) {
+  VOID (*routine)(ThreadState *, ADDRINT, BOOL) = (VOID (*)(ThreadState *, ADDRINT, BOOL))conditionalBranchRoutine;
+  ts->profile.branchRoutine.calls++;
+  if (--ts->untilNextTimedBranch) {
+    routine(ts, branchPC, branchWasTaken);
+    return;
+  }
+  ts->untilNextTimedBranch = selfProfilePeriod;
+  UINT64 start = __rdtsc();
+  routine(ts, branchPC, branchWasTaken);
+  ts->profile.branchRoutine.record(__rdtsc() - start);
 }
 
-// This function is called before every conditional branch is executed
+// This function is called before every conditional branch when several predictor
+// configurations are swept. Each of them predicts and trains on the same branch
 //
-static VOID AtConditionalBranch(ADDRINT branchPC, BOOL branchWasTaken) {
-  /*
-	 * This is the place where the predictor is queried for a prediction and trained
-	 */
+static VOID AtConditionalBranchSweep(ThreadState *ts, ADDRINT branchPC, BOOL branchWasTaken) {
+  LockPredictors(ts);
+  PredictorSet &set = *ts->predictors;
+  for (UINT32 i = 0; i < set.predictors.size(); i++) {
+    SimulatedPredictor &sim = set.predictors[i];
+    bool wasPredictedTaken = sim.predictor->predictAndTrain(branchPC, branchWasTaken);
+    sim.stats.record(wasPredictedTaken, branchWasTaken);
+    if (sim.profile) {
+      sim.profile->record(branchPC, wasPredictedTaken, branchWasTaken);
+    }
+  }
 
-  // Step 1: make a prediction for the current branch PC
-  //
-	bool wasPredictedTaken = branchPredictor->getPrediction(branchPC);
-  
-  // Step 2: train the predictor by passing it the actual branch outcome
-  //
-	branchPredictor->train(branchPC, branchWasTaken);
+  set.stream.record(branchWasTaken);
+  UnlockPredictors(ts);
+}
 
-  // Count the number of conditional branches executed
-  conditionalBranchesCount++;
-  
-  // Count the number of conditional branches predicted taken and not-taken
-  if (wasPredictedTaken) {
-    predictedTakenBranchesCount++;
-  } else {
-    predictedNotTakenBranchesCount++;
-  }
+// These functions are called with -front_end before every conditional branch, jump,
+// call and return respectively. They run the BTB, RAS and loop predictor of the thread
+//
+static VOID AtFrontEndConditionalBranch(ThreadState *ts, ADDRINT branchPC, ADDRINT target, BOOL branchWasTaken) {
+  LockPredictors(ts);
+  ts->predictors->frontEnd->conditionalBranch(branchPC, target, branchWasTaken);
+  UnlockPredictors(ts);
+}
 
-  // Count the number of conditional branches actually taken and not-taken
-  if (branchWasTaken) {
-    takenBranchesCount++;
-  } else {
-    notTakenBranchesCount++;
-  }
+static VOID AtFrontEndJump(ThreadState *ts, ADDRINT branchPC, ADDRINT target, BOOL indirect) {
+  LockPredictors(ts);
+  ts->predictors->frontEnd->takenBranch(branchPC, target, indirect);
+  UnlockPredictors(ts);
+}
+
+static VOID AtFrontEndCall(ThreadState *ts, ADDRINT branchPC, ADDRINT target, ADDRINT returnAddress, BOOL indirect) {
+  LockPredictors(ts);
+  ts->predictors->frontEnd->call(branchPC, target, returnAddress, indirect);
+  UnlockPredictors(ts);
+}
 
-  // Count the number of correct predictions
-	if (wasPredictedTaken == branchWasTaken)
-    correctPredictionCount++;
+static VOID AtFrontEndReturn(ThreadState *ts, ADDRINT target) {
+  LockPredictors(ts);
+  ts->predictors->frontEnd->ret(target);
+  UnlockPredictors(ts);
 }
 
 // Pin calls this function every time a new instruction is encountered
@@ -443,13 +1105,172 @@ static VOID AtConditionalBranch(ADDRINT branchPC, BOOL branchWasTaken) {
 // instruction that calls our branch prediction simulator (with the PC
 // value and the branch outcome).
 //
+VOID InstrumentConditionalBranch(INS ins) {
+  // Insert a call before every conditional branch
+  if (INS_IsBranch(ins) && INS_HasFallThrough(ins) && bufferBranches) {
+    AFUNPTR flush = selfProfile ? (AFUNPTR)SimulateBufferedBranchesProfiled : (AFUNPTR)SimulateBufferedBranches;
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordBufferedBranch, IARG_REG_VALUE, threadStateReg, IARG_INST_PTR, IARG_BRANCH_TAKEN, IARG_END);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, flush, IARG_REG_VALUE, threadStateReg, IARG_END);
+  }
+  else if (INS_IsBranch(ins) && INS_HasFallThrough(ins)) {
+    AFUNPTR routine = selfProfile ? (AFUNPTR)AtConditionalBranchProfiled : conditionalBranchRoutine;
+    INS_InsertCall(ins, IPOINT_BEFORE, routine, IARG_REG_VALUE, threadStateReg, IARG_INST_PTR, IARG_BRANCH_TAKEN, IARG_END);
+  }
+}
+
+// Inserts the calls of the front-end models (-front_end) before every control
+// flow instruction that the BTB, RAS or loop predictor sees
+//
+VOID InstrumentFrontEnd(INS ins) {
+  if (INS_IsRet(ins)) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtFrontEndReturn, IARG_REG_VALUE, threadStateReg, IARG_BRANCH_TARGET_ADDR, IARG_END);
+  }
+  else if (INS_IsCall(ins)) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtFrontEndCall, IARG_REG_VALUE, threadStateReg, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR,
+                   IARG_ADDRINT, INS_NextAddress(ins), IARG_BOOL, INS_IsIndirectControlFlow(ins), IARG_END);
+  }
+  else if (INS_IsBranch(ins) && INS_HasFallThrough(ins)) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtFrontEndConditionalBranch, IARG_REG_VALUE, threadStateReg, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR,
+                   IARG_BRANCH_TAKEN, IARG_END);
+  }
+  else if (INS_IsBranch(ins)) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtFrontEndJump, IARG_REG_VALUE, threadStateReg, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR,
+                   IARG_BOOL, INS_IsIndirectControlFlow(ins), IARG_END);
+  }
+}
+
 VOID Instruction(INS ins, VOID *v) {
   // Insert a call before every instruction that simply counts instructions executed
-  INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_END);
+  INS_InsertIfCall(ins, IPOINT_BEFORE, countRoutine, IARG_REG_VALUE, threadStateReg, IARG_UINT32, 1, IARG_END);
+  INS_InsertThenCall(ins, IPOINT_BEFORE, checkRoutine, IARG_REG_VALUE, threadStateReg, IARG_END);
 
-  // Insert a call before every conditional branch
-  if ( INS_IsBranch(ins) && INS_HasFallThrough(ins) ) {
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AtConditionalBranch, IARG_INST_PTR, IARG_BRANCH_TAKEN, IARG_END);
+  // between the windows of -sample_period nothing else is simulated
+  if (!sampleDetailed.load()) {
+    return;
+  }
+  InstrumentConditionalBranch(ins);
+  if (simulateFrontEnd) {
+    InstrumentFrontEnd(ins);
+  }
+}
+
+// Pin calls this function every time a new trace is encountered (used with -count_per_bbl).
+// Instead of a docount() call before every instruction, a single call is inserted at
+// the head of each basic block which adds the number of instructions in that block.
+// Conditional branches are still instrumented one by one.
+//
+VOID Trace(TRACE trace, VOID *v) {
+  BOOL detailed = sampleDetailed.load();
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, countRoutine, IARG_REG_VALUE, threadStateReg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, checkRoutine, IARG_REG_VALUE, threadStateReg, IARG_END);
+
+    for (INS ins = BBL_InsHead(bbl); detailed && INS_Valid(ins); ins = INS_Next(ins)) {
+      InstrumentConditionalBranch(ins);
+      if (simulateFrontEnd) {
+        InstrumentFrontEnd(ins);
+      }
+    }
+  }
+}
+
+BOOL CreateBranchPredictor(SimulatedPredictor &sim);
+VOID GroupGshareSweep(PredictorSet &set);
+VOID LoadPredictorState(PredictorSet &set);
+
+// Pin calls this function when an application thread starts. It sets up the
+// thread's buffer and, unless predictors are shared, its own predictors
+//
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+  ThreadState *ts = new ThreadState;
+  ts->tid = tid;
+  ts->untilNextTimedBranch = selfProfilePeriod;
+  ts->buffer.events.resize(KnobBatchSize.Value());
+  if (sharedPredictors) {
+    ts->predictors = &globalPredictors;
+    ts->predictorsLock = &predictorsLock;
+  }
+  else {
+    for (UINT32 i = 0; i < globalPredictors.predictors.size(); i++) {
+      SimulatedPredictor sim;
+      sim.config = globalPredictors.predictors[i].config;
+      CreateBranchPredictor(sim);
+      if (globalPredictors.predictors[i].profile) {
+        sim.profile = new BranchProfile(KnobProfileEntries.Value());
+      }
+      ts->privatePredictors.predictors.push_back(sim);
+    }
+    if (!globalPredictors.gshareGroups.empty()) {
+      GroupGshareSweep(ts->privatePredictors);
+    }
+    if (simulateFrontEnd) {
+      ts->privatePredictors.frontEnd = new FrontEndModel(frontEndConfig);
+    }
+    if (!loadedPredictorState.empty()) {
+      LoadPredictorState(ts->privatePredictors);
+    }
+    // threads that start after -skip count from the beginning
+    ts->countersReset = skipDone.load();
+    if (intervalLength) {
+      ts->privatePredictors.intervals.init(globalPredictors.predictors.size(), ExpectedIntervalRows());
+      ts->nextIntervalEnd = intervalLength;
+    }
+    ts->predictors = &ts->privatePredictors;
+    ts->predictorsLock = NULL;
+  }
+
+  PIN_SetThreadData(threadStateKey, ts, tid);
+  PIN_SetContextReg(ctxt, threadStateReg, (ADDRINT)ts);
+
+  PIN_GetLock(&threadStatesLock, tid + 1);
+  threadStates.push_back(ts);
+  PIN_ReleaseLock(&threadStatesLock);
+}
+
+// Simulates what is left in the thread's buffer, adds its instructions and (private)
+// counters to the global ones and frees the thread state
+//
+VOID RetireThreadState(ThreadState *ts) {
+  SimulateBufferedBranches(ts);
+  if (intervalLength && ts->predictors == &ts->privatePredictors) {
+    // the last interval of the thread ends here, whatever its length
+    ts->privatePredictors.intervals.record(ts->iCount, ts->privatePredictors.stream, ts->privatePredictors.predictors);
+  }
+
+  PIN_GetLock(&threadStatesLock, ts->tid + 1);
+  BOOL lastThread = threadStates.size() == 1;
+  iCount += ts->iCount - ts->reportedICount;
+  simulatorProfile.merge(ts->profile);
+  if (ts->predictors == &ts->privatePredictors) {
+    globalPredictors.merge(ts->privatePredictors);
+  }
+  threadStates.erase(std::find(threadStates.begin(), threadStates.end(), ts));
+  PIN_ReleaseLock(&threadStatesLock);
+
+  if (saveStateAtEnd && lastThread && ts->predictors == &ts->privatePredictors) {
+    // private predictors are freed with their thread, so the snapshot is taken
+    // from the last thread that ends
+    WritePredictorState(ts->privatePredictors, iCount.load());
+  }
+
+  for (UINT32 i = 0; i < ts->privatePredictors.predictors.size(); i++) {
+    delete ts->privatePredictors.predictors[i].predictor;
+    delete ts->privatePredictors.predictors[i].profile;
+  }
+  for (UINT32 i = 0; i < ts->privatePredictors.gshareGroups.size(); i++) {
+    delete ts->privatePredictors.gshareGroups[i].kernel;
+  }
+  delete ts->privatePredictors.frontEnd;
+  delete ts;
+}
+
+// Pin calls this function when an application thread exits
+//
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+  ThreadState *ts = static_cast<ThreadState *>(PIN_GetThreadData(threadStateKey, tid));
+  if (ts != NULL) {
+    RetireThreadState(ts);
+    PIN_SetThreadData(threadStateKey, NULL, tid);
   }
 }
 
@@ -460,68 +1281,485 @@ INT32 Usage() {
   return -1;
 }
 
+/* Creates the predictor of a SimulatedPredictor for CreateBranchPredictorOfType() */
+// The predictor object is built from sim.config, together with the routines
+// specialized for its class
+//
+struct SimulatedPredictorFactory {
+  SimulatedPredictor &sim;
+
+  template <class Predictor>
+  VOID create() {
+    sim.predictor = new Predictor(sim.config);
+    sim.simulateBatch = SimulateBranchBatch<Predictor>;
+    sim.conditionalBranchRoutine = (AFUNPTR)AtConditionalBranch<Predictor>;
+  }
+};
+
+// Create a branch predictor object of the type requested by sim.config.
+// Returns false for an unknown type
+//
+BOOL CreateBranchPredictor(SimulatedPredictor &sim) {
+  SimulatedPredictorFactory factory = {sim};
+  return CreateBranchPredictorOfType(sim.config, factory, KnobStaticPredictors.Value());
+}
+
+// Puts the gshare predictors of set that have the same number of entries, if there
+// are at least two of them, into a GshareSweepGroup each. Their own predictor
+// objects are freed, only the kernel of the group is simulated from then on.
+// A profiled predictor is left out, the kernel does not report single branches,
+// and so is one with an update delay, which the kernel does not model
+//
+VOID GroupGshareSweep(PredictorSet &set) {
+  vector<BOOL> grouped(set.predictors.size(), false);
+  for (UINT32 i = 0; i < set.predictors.size(); i++) {
+    if (grouped[i] || set.predictors[i].config.type != "gshare" || set.predictors[i].profile || set.predictors[i].config.updateDelay) {
+      continue;
+    }
+    GshareSweepGroup group;
+    vector<UINT32> historyBits;
+    for (UINT32 j = i; j < set.predictors.size(); j++) {
+      const BranchPredictorConfig &config = set.predictors[j].config;
+      if (config.type == "gshare" && config.numEntries == set.predictors[i].config.numEntries && !set.predictors[j].profile && !config.updateDelay) {
+        group.members.push_back(j);
+        historyBits.push_back(config.globalHistoryBitsOrDefault());
+      }
+    }
+    if (group.members.size() < 2) {
+      continue;
+    }
+
+    group.kernel = new GshareSweepKernel(set.predictors[i].config.numEntries, historyBits);
+    group.laneStats.resize(group.members.size());
+    for (UINT32 k = 0; k < group.members.size(); k++) {
+      SimulatedPredictor &sim = set.predictors[group.members[k]];
+      delete sim.predictor;
+      sim.predictor = NULL;
+      sim.simulateBatch = NULL;
+      grouped[group.members[k]] = true;
+    }
+    set.gshareGroups.push_back(group);
+  }
+}
+
+// Saves the state of every predictor of set to archive, or loads it. Predictors
+// simulated by a gshare kernel go through their lane of it, in the same layout
+//
+VOID SerializePredictorSet(PredictorStateArchive &archive, PredictorSet &set) {
+  archive.expect(PREDICTOR_STATE_MAGIC);
+  archive.expect(PREDICTOR_STATE_VERSION);
+  archive.expect((UINT64)set.predictors.size());
+  for (UINT32 i = 0; i < set.predictors.size(); i++) {
+    SimulatedPredictor &sim = set.predictors[i];
+    SerializeBranchPredictorConfig(archive, sim.config);
+    if (sim.predictor) {
+      sim.predictor->serialize(archive);
+      continue;
+    }
+    for (UINT32 g = 0; g < set.gshareGroups.size(); g++) {
+      GshareSweepGroup &group = set.gshareGroups[g];
+      for (UINT32 k = 0; k < group.members.size(); k++) {
+        if (group.members[k] == i) {
+          group.kernel->serializeLane(archive, k);
+        }
+      }
+    }
+  }
+
+  archive.expect(set.frontEnd != NULL);
+  if (set.frontEnd) {
+    archive.expect(frontEndConfig.numBTBEntries);
+    archive.expect(frontEndConfig.numBTBWays);
+    archive.expect(frontEndConfig.numRASEntries);
+    archive.expect(frontEndConfig.numLoopEntries);
+    set.frontEnd->serialize(archive);
+  }
+}
+
+// Ends an interval of the predictors of ts at instructions (-intervals). The branches
+// in its buffer and in the ring were executed before, so they are simulated first.
+// Other threads sharing the predictors may still have a few buffered branches
+//
+VOID RecordInterval(ThreadState *ts, UINT64 instructions) {
+  SimulateBufferedBranches(ts);
+
+  LockPredictors(ts);
+  if (simulatorThreadsRunning) {
+    branchBatchRing.waitUntilConsumed();
+  }
+  PredictorSet &set = *ts->predictors;
+  set.intervals.record(instructions, set.stream, set.predictors);
+  UnlockPredictors(ts);
+}
+
+// Clears the counters of set, keeping what its predictors have learnt
+//
+VOID ResetCounters(PredictorSet &set) {
+  for (UINT32 i = 0; i < set.predictors.size(); i++) {
+    set.predictors[i].stats = BranchPredictorStats();
+    if (set.predictors[i].profile) {
+      set.predictors[i].profile->clear();
+    }
+  }
+  set.stream = BranchStreamStats();
+  if (set.frontEnd) {
+    set.frontEnd->stats = FrontEndStats();
+  }
+}
+
+// Starts counting for the predictors of ts at the end of -skip, at instructions. The
+// branches in its buffer and in the ring were executed during the skip, so they are
+// simulated first. The interval that is running ends here. With private predictors
+// the first thread to get here also clears the counters of the threads that exited
+//
+VOID EndSkip(ThreadState *ts, UINT64 instructions) {
+  SimulateBufferedBranches(ts);
+
+  LockPredictors(ts);
+  if (simulatorThreadsRunning) {
+    branchBatchRing.waitUntilConsumed();
+  }
+  PredictorSet &set = *ts->predictors;
+  if (intervalLength) {
+    set.intervals.record(instructions, set.stream, set.predictors);
+    set.intervals.rebase();
+  }
+  ResetCounters(set);
+  if (samplePeriod) {
+    // the first window of -sample_period starts here
+    set.samples.skipTo(instructions, set.stream, set.predictors);
+    sampleWindowStart = instructions;
+    nextSampleSwitchInstrNum.store(instructions + sampleWindow);
+  }
+  UnlockPredictors(ts);
+
+  PIN_GetLock(&threadStatesLock, ts->tid + 1);
+  if (!sharedPredictors && countedFromInstrNum == 0) {
+    ResetCounters(globalPredictors);
+  }
+  countedFromInstrNum = skipInstrNum;
+  ts->countersReset = true;
+  PIN_ReleaseLock(&threadStatesLock);
+}
+
+// Ends the detailed window of -sample_period at instructions, or starts the next one.
+// The branches in the buffer of ts and in the ring were executed before, so they
+// are simulated first. Pin then throws away the instrumented code, and Trace() or
+// Instruction() instrument it again for the new mode when it is next executed.
+// The traces that are running keep their old code until they are left, so a few
+// branches right after the switch may still be simulated or missed
+//
+VOID SwitchSampleMode(ThreadState *ts, UINT64 instructions) {
+  SimulateBufferedBranches(ts);
+
+  LockPredictors(ts);
+  if (simulatorThreadsRunning) {
+    branchBatchRing.waitUntilConsumed();
+  }
+  PredictorSet &set = *ts->predictors;
+  if (sampleDetailed.load()) {
+    set.samples.record(instructions, set.stream, set.predictors);
+    sampleDetailed.store(false);
+    nextSampleSwitchInstrNum.store(sampleWindowStart + samplePeriod);
+  }
+  else {
+    set.samples.skipTo(instructions, set.stream, set.predictors);
+    sampleDetailed.store(true);
+    sampleWindowStart = instructions;
+    nextSampleSwitchInstrNum.store(instructions + sampleWindow);
+  }
+  UnlockPredictors(ts);
+
+  PIN_RemoveInstrumentation();
+}
+
+// Writes the state of the predictors of ts to -save_state once total instructions
+// have been executed. The branches in its buffer and those still in the ring were
+// executed before, so they are simulated first. Other threads may have a few
+// buffered branches left, so with several threads the point is not exact
+//
+VOID SavePredictorState(ThreadState *ts, UINT64 total) {
+  SimulateBufferedBranches(ts);
+
+  LockPredictors(ts);
+  if (simulatorThreadsRunning) {
+    branchBatchRing.waitUntilConsumed();
+  }
+  WritePredictorState(*ts->predictors, total);
+  UnlockPredictors(ts);
+}
+
+// Writes the state of the predictors of set to -save_state, terminating the
+// simulation if the file cannot be written
+//
+VOID WritePredictorState(PredictorSet &set, UINT64 total) {
+  ofstream file(KnobSaveState.Value().c_str(), ios::binary | ios::trunc);
+  PredictorStateArchive archive(file);
+  SerializePredictorSet(archive, set);
+  file.close();
+  stateSaved.store(true);
+
+  if (!archive.good() || !file) {
+    std::cerr << "Error: Could not write " << KnobSaveState.Value() << ". Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  std::cerr << "Saved the predictor state at iCount = " << total << " to " << KnobSaveState.Value() << "." << endl;
+}
+
+// Starts the predictors of set from the snapshot read with -load_state, terminating
+// the simulation if it was taken with other predictors or sizes
+//
+VOID LoadPredictorState(PredictorSet &set) {
+  std::istringstream input(loadedPredictorState);
+  PredictorStateArchive archive(input);
+  SerializePredictorSet(archive, set);
+  if (!archive.good() || input.peek() != EOF) {
+    std::cerr << "Error: " << KnobLoadState.Value() << " does not hold the state of the configured predictors. "
+              << "Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+// Checks the sizes and history lengths of config, terminating the simulation if they are not supported
+//
+VOID ValidateBranchPredictorConfig(const BranchPredictorConfig &config) {
+  const char *error = CheckBranchPredictorConfig(config);
+  if (error) {
+    std::cerr << "Error: " << error << " Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+}
+
 int main(int argc, char * argv[]) {
   // Initialize pin
   if (PIN_Init(argc, argv)) return Usage();
+  startCycles = __rdtsc();
+  startTime = std::chrono::steady_clock::now();
 
-  // Create a branch predictor object of requested type
-  if (KnobBranchPredictorType.Value() == "always_taken") {
-    std::cerr << "Using always taken BP" << std::endl;
-    branchPredictor = new AlwaysTakenBranchPredictor(KnobNumberOfEntriesInBranchPredictor.Value());
-  }
-//------------------------------------------------------------------------------
-//##############################################################################
-/*
- * Insert your changes below here...
- *
- * In the following cascading if-statements instantiate branch predictor objects
- * using the classes that you have implemented for each of the three types of
- * predictor.
- *
- * The choice of predictor, and the number of entries in its prediction table
- * can be obtained from the command line arguments of this Pin tool using:
- *
- *  KnobNumberOfEntriesInBranchPredictor.Value() 
- *    returns the integer value specified by tool option "-num_BP_entries".
- *
- *  KnobBranchPredictorType.Value() 
- *    returns the value specified by tool option "-BP_type".
- *    The argument of tool option "-BP_type" must be one of the strings: 
- *        "always_taken",  "local",  "gshare",  "tournament"
- *
- *  Please DO NOT CHANGE these strings - they will be used for testing your code
- */
-//##############################################################################
-//------------------------------------------------------------------------------
-  else if (KnobBranchPredictorType.Value() == "local") {
-  	 std::cerr << "Using Local BP." << std::endl;
-/* Uncomment when you have implemented a Local branch predictor */
-    branchPredictor = new LocalBranchPredictor(KnobNumberOfEntriesInBranchPredictor.Value());
-  }
-  else if (KnobBranchPredictorType.Value() == "gshare") {
-  	 std::cerr << "Using Gshare BP."<< std::endl;
-/* Uncomment when you have implemented a Gshare branch predictor */
-    branchPredictor = new GshareBranchPredictor(KnobNumberOfEntriesInBranchPredictor.Value());
-  }
-  else if (KnobBranchPredictorType.Value() == "tournament") {
-  	 std::cerr << "Using Tournament BP." << std::endl;
-/* Uncomment when you have implemented a Tournament branch predictor */
-    branchPredictor = new TournamentBranchPredictor(KnobNumberOfEntriesInBranchPredictor.Value());
+  if (KnobOutputFormat.Value() != "text" && KnobOutputFormat.Value() != "json" && KnobOutputFormat.Value() != "csv") {
+    std::cerr << "Error: -output_format must be text, json or csv. Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
   }
-  else {
-    std::cerr << "Error: No such type of branch predictor. Simulation will be terminated." << std::endl;
+
+  if (KnobStopInstructions.Value() > 0) {
+    stopInstrNum = KnobStopInstructions.Value();
+  }
+  if (KnobHeartbeatInstructions.Value() > 0) {
+    heartbeatInterval = KnobHeartbeatInstructions.Value();
+    nextHeartbeatInstrNum.store(heartbeatInterval);
+  }
+  if (KnobSkipInstructions.Value() > 0) {
+    skipInstrNum = KnobSkipInstructions.Value();
+  }
+
+  BranchPredictorConfig config;
+  config.type               = KnobBranchPredictorType.Value();
+  config.numEntries         = KnobNumberOfEntriesInBranchPredictor.Value();
+  config.numLHTEntries      = KnobNumberOfLocalHistoryTableEntries.Value();
+  config.localHistoryBits   = KnobLocalHistoryBits.Value();
+  config.globalHistoryBits  = KnobGlobalHistoryBits.Value();
+  config.hybridComponents   = KnobHybridComponents.Value();
+  config.chooserHistoryBits = KnobChooserHistoryBits.Value();
+  config.updateDelay        = KnobUpdateDelay.Value();
+
+  vector<BranchPredictorConfig> configs;
+  if (KnobSweep.Value().empty()) {
+    configs.push_back(config);
+  }
+  else if (!ParseSweepConfigs(KnobSweep.Value(), config, configs)) {
+    std::cerr << "Error: Malformed -sweep list. Simulation will be terminated." << std::endl;
     std::exit(EXIT_FAILURE);
   }
 
-  std::cerr << "The simulation will run " << STOP_INSTR_NUM << " instructions." << std::endl;
+  // Create a branch predictor object of requested type for every configuration
+  for (UINT32 i = 0; i < configs.size(); i++) {
+    ValidateBranchPredictorConfig(configs[i]);
+
+    SimulatedPredictor sim;
+    sim.config = configs[i];
+    if (!CreateBranchPredictor(sim)) {
+      std::cerr << "Error: No such type of branch predictor. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    std::cerr << "Using " << configs[i].type << " BP with " << configs[i].numEntries << " entries." << std::endl;
+    globalPredictors.predictors.push_back(sim);
+  }
+  if (KnobProfileBranches.Value() > 0) {
+    if (KnobProfileEntries.Value() == 0) {
+      std::cerr << "Error: -profile_entries must not be 0. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    globalPredictors.predictors[0].profile = new BranchProfile(KnobProfileEntries.Value());
+  }
+  if (KnobSweepKernel.Value() && KnobBatchSize.Value() > 0) {
+    // branches only reach the kernels in batches
+    GroupGshareSweep(globalPredictors);
+  }
+
+  if (KnobFrontEnd.Value()) {
+    frontEndConfig.numBTBEntries  = KnobNumberOfBTBEntries.Value();
+    frontEndConfig.numBTBWays     = KnobBTBWays.Value();
+    frontEndConfig.numRASEntries  = KnobNumberOfRASEntries.Value();
+    frontEndConfig.numLoopEntries = KnobNumberOfLoopEntries.Value();
+    const char *error = CheckFrontEndConfig(frontEndConfig);
+    if (error) {
+      std::cerr << "Error: " << error << " Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    simulateFrontEnd = true;
+    globalPredictors.frontEnd = new FrontEndModel(frontEndConfig);
+  }
+
+  if (!KnobLoadState.Value().empty()) {
+    std::ifstream file(KnobLoadState.Value().c_str(), ios::binary);
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    if (!file || contents.str().empty()) {
+      std::cerr << "Error: Could not read " << KnobLoadState.Value() << ". Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    loadedPredictorState = contents.str();
+    // the global predictors are the ones simulated in -thread_mode shared, and checking
+    // the snapshot against them catches a mismatch before the application starts
+    LoadPredictorState(globalPredictors);
+    std::cerr << "Loaded the predictor state from " << KnobLoadState.Value() << "." << std::endl;
+  }
+  if (!KnobIntervals.Value().empty()) {
+    if (KnobIntervalInstructions.Value() == 0) {
+      std::cerr << "Error: -interval_instrs must not be 0. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (KnobIntervalFormat.Value() != "csv" && KnobIntervalFormat.Value() != "json") {
+      std::cerr << "Error: -interval_format must be csv or json. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    intervalLength = KnobIntervalInstructions.Value();
+    nextIntervalInstrNum.store(intervalLength);
+    globalPredictors.intervals.init(globalPredictors.predictors.size(), ExpectedIntervalRows());
+  }
+  if (KnobSamplePeriod.Value() > 0) {
+    if (KnobSampleWindow.Value() == 0 || KnobSampleWindow.Value() >= KnobSamplePeriod.Value()) {
+      std::cerr << "Error: -sample_window must be between 0 and -sample_period. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    if (intervalLength) {
+      std::cerr << "Error: -intervals cannot be combined with -sample_period. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    samplePeriod = KnobSamplePeriod.Value();
+    sampleWindow = KnobSampleWindow.Value();
+    // with -skip the first window starts at its end, EndSkip() sets the switch point then
+    if (skipInstrNum == NO_INSTR_NUM) {
+      nextSampleSwitchInstrNum.store(sampleWindow);
+    }
+    UINT64 expectedWindows = stopInstrNum == NO_INSTR_NUM ? UNBOUNDED_INTERVAL_ROWS : stopInstrNum / samplePeriod + 1;
+    globalPredictors.samples.init(globalPredictors.predictors.size(), expectedWindows);
+  }
+  if (!KnobSaveState.Value().empty()) {
+    saveStateInstrNum = KnobSaveStateAt.Value();
+    saveStateAtEnd = KnobSaveStateAt.Value() == 0;
+  }
+
+  if (KnobThreadMode.Value() == "shared" || KnobSimulatorThreads.Value() > 0 || samplePeriod) {
+    // the simulator threads only consume batches for the global predictors, and the
+    // windows of -sample_period are cut from the counters of all threads at once
+    sharedPredictors = true;
+  }
+  else if (KnobThreadMode.Value() != "private") {
+    std::cerr << "Error: -thread_mode must be private or shared. Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  PIN_InitLock(&predictorsLock);
+  PIN_InitLock(&threadStatesLock);
+  threadStateKey = PIN_CreateThreadDataKey(NULL);
+  threadStateReg = PIN_ClaimToolRegister();
+  if (!REG_valid(threadStateReg)) {
+    std::cerr << "Error: No tool register available. Simulation will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  if (KnobSelfProfile.Value()) {
+    if (KnobSelfProfilePeriod.Value() == 0) {
+      std::cerr << "Error: -self_profile_period must not be 0. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    selfProfile = true;
+    selfProfilePeriod = KnobSelfProfilePeriod.Value();
+  }
+  countRoutine = selfProfile ? (AFUNPTR)docountProfiled : (AFUNPTR)docount;
+  checkRoutine = selfProfile ? (AFUNPTR)CheckInstructionCountProfiled : (AFUNPTR)CheckInstructionCount;
+
+  if (KnobBatchSize.Value() > 0) {
+    bufferBranches = true;
+  }
+  else if (globalPredictors.predictors.size() == 1) {
+    conditionalBranchRoutine = globalPredictors.predictors[0].conditionalBranchRoutine;
+  }
+  else {
+    // Several configurations go through the generic loop instead of a specialized routine
+    conditionalBranchRoutine = (AFUNPTR)AtConditionalBranchSweep;
+  }
+
+  if (!KnobRecordTrace.Value().empty()) {
+    if (KnobBatchSize.Value() == 0) {
+      std::cerr << "Error: -record_trace requires -batch_size. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    PIN_InitLock(&traceWriterLock);
+    traceWriter = new BranchTraceWriter;
+    if (!traceWriter->open(KnobRecordTrace.Value())) {
+      std::cerr << "Error: Could not open " << KnobRecordTrace.Value() << ". Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  if (KnobSimulatorThreads.Value() > 0) {
+    if (KnobBatchSize.Value() == 0) {
+      std::cerr << "Error: -sim_threads requires -batch_size. Simulation will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    // each thread runs a share of the predictors, more threads than predictors would have nothing to do
+    UINT32 numThreads = KnobSimulatorThreads.Value();
+    if (numThreads > globalPredictors.predictors.size()) {
+      numThreads = globalPredictors.predictors.size();
+    }
+    StartSimulatorThreads(numThreads, KnobBatchSize.Value());
+  }
+
+  if (stopInstrNum != NO_INSTR_NUM) {
+    std::cerr << "The simulation will run " << stopInstrNum << " instructions." << std::endl;
+  }
+  if (skipInstrNum != NO_INSTR_NUM) {
+    std::cerr << "The first " << skipInstrNum << " instructions only train the predictors." << std::endl;
+  }
+  if (samplePeriod) {
+    std::cerr << "Only " << sampleWindow << " of every " << samplePeriod << " instructions are simulated." << std::endl;
+  }
 
   OutFile.open(KnobOutputFile.Value().c_str());
 
-  // Pin calls Instruction() when encountering each new instruction executed
-  INS_AddInstrumentFunction(Instruction, 0);
+  if (KnobCountPerBasicBlock.Value()) {
+    // Pin calls Trace() when encountering each new trace executed
+    TRACE_AddInstrumentFunction(Trace, 0);
+  }
+  else {
+    // Pin calls Instruction() when encountering each new instruction executed
+    INS_AddInstrumentFunction(Instruction, 0);
+  }
+
+  if (KnobProfileBranches.Value() > 0) {
+    // routine names for the profile, and ImageLoad() for the image of every branch
+    PIN_InitSymbols();
+    IMG_AddInstrumentFunction(ImageLoad, 0);
+  }
+
+  PIN_AddThreadStartFunction(ThreadStart, 0);
+  PIN_AddThreadFiniFunction(ThreadFini, 0);
 
   // Function to be called if the program finishes before it completes 10b instructions
   PIN_AddFiniFunction(Fini, 0);
+  PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
 
   // Callback functions to invoke before Pin releases control of the application
   PIN_AddDetachFunction(TerminateSimulationHandler, 0);
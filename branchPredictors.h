@@ -0,0 +1,2756 @@
+#ifndef BRANCH_PREDICTORS_H
+#define BRANCH_PREDICTORS_H
+
+/* Branch predictor models */
+// Nothing in here depends on Pin, so the same predictors are used by the Pin tool
+// (branchPredictors.cpp) and by the native trace replay driver (branchReplay.cpp).
+//
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <istream>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Cache-line-aligned memory for predictor state */
+// The predictor objects (through BranchPredictorInterface::operator new) and their
+// tables (through CacheAlignedVector) start on a cache line. The histories, masks
+// and table pointers that every branch reads then share as few lines as possible,
+// and an entry of a table never straddles a line boundary that it would not
+// straddle in the table itself. The address malloc() returned is kept in the
+// pointer-sized slot right before the aligned block.
+//
+static const uintptr_t CACHE_LINE_BYTES = 64;
+
+inline void *AllocateCacheAligned(size_t bytes) {
+  void *block = std::malloc(bytes + sizeof(void *) + CACHE_LINE_BYTES - 1);
+  if (block == NULL) {
+    throw std::bad_alloc();
+  }
+  uintptr_t aligned = ((uintptr_t)block + sizeof(void *) + CACHE_LINE_BYTES - 1) & ~(CACHE_LINE_BYTES - 1);
+  ((void **)aligned)[-1] = block;
+  return (void *)aligned;
+}
+
+inline void FreeCacheAligned(void *aligned) {
+  if (aligned != NULL) {
+    std::free(((void **)aligned)[-1]);
+  }
+}
+
+template <class T>
+struct CacheAlignedAllocator {
+  typedef T value_type;
+
+  CacheAlignedAllocator() {}
+
+  template <class U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(AllocateCacheAligned(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t) {
+    FreeCacheAligned(p);
+  }
+};
+
+template <class T, class U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+  return false;
+}
+
+template <class T>
+using CacheAlignedVector = std::vector<T, CacheAlignedAllocator<T> >;
+
+/* Binary snapshot of predictor state, written to or read from a stream */
+// Every predictor has a single serialize() member that goes through its state in a
+// fixed order and hands each part to the archive, which either writes it or
+// overwrites it with what it reads. Saving and loading therefore cannot drift
+// apart. Parts whose size follows from the configuration are written with their
+// element count, and expect() writes a value on saving and checks it on loading,
+// so a snapshot of differently sized predictors is refused instead of misread.
+// The layout matches the in-memory layout of the host, it is not meant to move
+// between machines.
+//
+class PredictorStateArchive {
+
+private:
+
+  std::ostream *out;
+  std::istream *in;
+  bool failed;
+
+public:
+
+  explicit PredictorStateArchive(std::ostream &output) : out(&output), in(NULL), failed(false) {}
+  explicit PredictorStateArchive(std::istream &input) : out(NULL), in(&input), failed(false) {}
+
+  bool loading() const {
+    return in != NULL;
+  }
+
+  // false once the stream failed or a loaded part did not match
+  bool good() const {
+    return !failed && (out ? out->good() : in->good());
+  }
+
+  void bytes(void *data, uint64_t size) {
+    if (out) {
+      out->write((const char *)data, size);
+    }
+    else if (!failed && !in->read((char *)data, size)) {
+      failed = true;
+    }
+  }
+
+  template <class T>
+  void value(T &v) {
+    bytes(&v, sizeof(v));
+  }
+
+  template <class T>
+  void expect(const T &v) {
+    T stored = v;
+    value(stored);
+    if (!(stored == v)) {
+      failed = true;
+    }
+  }
+
+  void expect(const std::string &v) {
+    expect((uint64_t)v.size());
+    std::string stored = v;
+    bytes(&stored[0], stored.size());
+    if (stored != v) {
+      failed = true;
+    }
+  }
+
+  template <class T, class Allocator>
+  void array(std::vector<T, Allocator> &elements) {
+    expect((uint64_t)elements.size());
+    if (!failed) {
+      bytes(elements.data(), elements.size() * sizeof(T));
+    }
+  }
+
+  template <class T, size_t size>
+  void array(std::array<T, size> &elements) {
+    expect((uint64_t)size);
+    if (!failed) {
+      bytes(elements.data(), size * sizeof(T));
+    }
+  }
+};
+
+/* Table of saturating counters packed into 64-bit words */
+// Each counter is counterBits wide, so one word holds 64 / counterBits counters
+// (32 two-bit counters). A counter predicts taken when its most significant bit is set.
+// Accesses are not bounds checked: callers mask their indices to the table size.
+// The words are a CacheAlignedVector by default; predictors whose size is known at
+// compile time keep them in a std::array inside the object instead
+// (FixedTwoBitCounterTable).
+//
+template <uint32_t counterBits, class Words = CacheAlignedVector<uint64_t> >
+class SaturatingCounterTable {
+
+private:
+
+  static const uint32_t COUNTERS_PER_WORD = 64 / counterBits;
+  static const uint64_t COUNTER_MAX       = (1ULL << counterBits) - 1;
+  static const uint64_t TAKEN_THRESHOLD   = 1ULL << (counterBits - 1);
+
+  uint64_t numCounters;
+  Words words;
+
+  static uint32_t shiftOf(uint64_t index) {
+    return (index % COUNTERS_PER_WORD) * counterBits;
+  }
+
+  static void fillWords(CacheAlignedVector<uint64_t> &storage, uint64_t numWords, uint64_t pattern) {
+    storage.assign(numWords, pattern);
+  }
+
+  template <size_t numWords>
+  static void fillWords(std::array<uint64_t, numWords> &storage, uint64_t, uint64_t pattern) {
+    storage.fill(pattern);
+  }
+
+public:
+
+  SaturatingCounterTable(uint64_t numberOfCounters, uint64_t initialValue) : numCounters(numberOfCounters) {
+    // every word starts with all of its counters set to initialValue
+    uint64_t pattern = 0;
+    for (uint32_t i = 0; i < COUNTERS_PER_WORD; i ++){
+      pattern |= (initialValue & COUNTER_MAX) << (i * counterBits);
+    }
+    fillWords(words, (numCounters + COUNTERS_PER_WORD - 1) / COUNTERS_PER_WORD, pattern);
+  }
+
+  uint64_t size() const {
+    return numCounters;
+  }
+
+  uint64_t get(uint64_t index) const {
+    return (words[index / COUNTERS_PER_WORD] >> shiftOf(index)) & COUNTER_MAX;
+  }
+
+  void set(uint64_t index, uint64_t value) {
+    uint64_t &word = words[index / COUNTERS_PER_WORD];
+    uint32_t shift = shiftOf(index);
+    word = (word & ~(COUNTER_MAX << shift)) | ((value & COUNTER_MAX) << shift);
+  }
+
+  // The packed words are the same for a vector and a std::array of the same
+  // size, so runtime and fixed-size tables load each other's snapshots
+  void serialize(PredictorStateArchive &archive) {
+    archive.array(words);
+  }
+
+  bool isTaken(uint64_t index) const {
+    return get(index) >= TAKEN_THRESHOLD;
+  }
+
+  void increment(uint64_t index) {
+    uint64_t &word = words[index / COUNTERS_PER_WORD];
+    uint32_t shift = shiftOf(index);
+    if (((word >> shift) & COUNTER_MAX) < COUNTER_MAX){
+      word += 1ULL << shift;
+    }
+  }
+
+  void decrement(uint64_t index) {
+    uint64_t &word = words[index / COUNTERS_PER_WORD];
+    uint32_t shift = shiftOf(index);
+    if (((word >> shift) & COUNTER_MAX) > 0){
+      word -= 1ULL << shift;
+    }
+  }
+
+  // Returns the prediction of the counter and then moves it towards the outcome,
+  // touching the word that holds it only once
+  bool predictAndUpdate(uint64_t index, bool branchWasTaken) {
+    uint64_t &word = words[index / COUNTERS_PER_WORD];
+    uint32_t shift = shiftOf(index);
+    uint64_t counter = (word >> shift) & COUNTER_MAX;
+    if (branchWasTaken) {
+      if (counter < COUNTER_MAX){
+        word += 1ULL << shift;
+      }
+    }
+    else if (counter > 0){
+      word -= 1ULL << shift;
+    }
+    return counter >= TAKEN_THRESHOLD;
+  }
+};
+
+typedef SaturatingCounterTable<2> TwoBitCounterTable;
+
+template <uint64_t numCounters>
+using FixedTwoBitCounterTable = SaturatingCounterTable<2, std::array<uint64_t, (numCounters + 31) / 32> >;
+
+/* Sizes and history lengths of a branch predictor, taken from the tool options */
+//
+struct BranchPredictorConfig {
+  std::string type;
+  uint64_t numEntries;         // PHT entries, also used for the tournament chooser
+  uint64_t numLHTEntries;      // local history table entries
+  uint32_t localHistoryBits;   // 0 means log2 of numEntries
+  uint32_t globalHistoryBits;  // 0 means log2 of numEntries, or a longer default for tage and perceptron
+  std::string hybridComponents = "local+gshare";  // components of a hybrid predictor, separated by '+'
+  uint32_t chooserHistoryBits  = 0;               // global history bits in the hybrid chooser index
+  uint32_t updateDelay         = 0;               // branches between the prediction of a branch and its update
+
+  static const uint32_t TAGE_DEFAULT_HISTORY_BITS       = 200;
+  static const uint32_t PERCEPTRON_DEFAULT_HISTORY_BITS = 32;
+  static const uint32_t MAX_UPDATE_DELAY                = 4096;
+
+  uint32_t localHistoryBitsOrDefault() const {
+    return localHistoryBits ? localHistoryBits : ceilLog2(numEntries);
+  }
+
+  uint32_t globalHistoryBitsOrDefault() const {
+    if (globalHistoryBits) {
+      return globalHistoryBits;
+    }
+    if (type == "tage") {
+      return TAGE_DEFAULT_HISTORY_BITS;
+    }
+    if (type == "perceptron") {
+      return PERCEPTRON_DEFAULT_HISTORY_BITS;
+    }
+    return ceilLog2(numEntries);
+  }
+
+  static uint32_t ceilLog2(uint64_t value) {
+    uint32_t bits = 0;
+    while (bits < 64 && (1ULL << bits) < value) {
+      bits ++;
+    }
+    return bits;
+  }
+};
+
+// Mask keeping the historyBits least significant bits of a history register
+inline uint64_t historyMaskOf(uint32_t historyBits) {
+  return historyBits >= 64 ? ~0ULL : (1ULL << historyBits) - 1;
+}
+
+/* Maps a PC or history hash onto [0, numberOfEntries) for any table size */
+// Power-of-two sizes use a mask that is computed once here. Other sizes use a
+// fast remainder: a multiply by a precomputed 64-bit reciprocal of the size,
+// exact for the 32-bit fold of the hash (Lemire et al., "Faster Remainder by
+// Direct Computation"), instead of a division on every branch.
+//
+class TableIndexer {
+
+private:
+
+  uint64_t numEntries;
+  uint64_t mask;
+  uint64_t reciprocal;
+  bool powerOfTwo;
+
+public:
+
+  TableIndexer(uint64_t numberOfEntries)
+    : numEntries(numberOfEntries),
+      mask(numberOfEntries - 1),
+      reciprocal(~0ULL / numberOfEntries + 1),
+      powerOfTwo((numberOfEntries & (numberOfEntries - 1)) == 0) {}
+
+  uint64_t size() const {
+    return numEntries;
+  }
+
+  uint64_t operator()(uint64_t hash) const {
+    if (powerOfTwo) {
+      return hash & mask;
+    }
+    uint32_t folded = (uint32_t)(hash ^ (hash >> 32));
+    uint64_t fraction = reciprocal * folded;
+    return (uint64_t)(((unsigned __int128)fraction * numEntries) >> 64);
+  }
+};
+
+/* Global history of branch outcomes */
+// A shift register of the outcomes of the last length branches, the most recent
+// in bit 0. One bit more than length is kept, so that FoldedHistory can see the
+// outcome that has just left the window. The first 64 bits are a plain word;
+// only histories longer than that need the older words.
+//
+class GlobalHistoryRegister {
+
+private:
+
+  uint32_t length;
+  uint64_t recent;
+  uint64_t recentMask;
+  std::vector<uint64_t> older;
+  uint64_t oldestMask;
+
+public:
+
+  GlobalHistoryRegister(uint32_t historyLength)
+    : length(historyLength),
+      recent(0),
+      recentMask(historyMaskOf(historyLength + 1)),
+      older(historyLength / 64, 0),
+      oldestMask(historyMaskOf((historyLength + 1) % 64 ? (historyLength + 1) % 64 : 64)) {}
+
+  uint32_t size() const {
+    return length;
+  }
+
+  // The last min(length, 64) outcomes
+  uint64_t value() const {
+    return length >= 64 ? recent : recent & (recentMask >> 1);
+  }
+
+  // Outcome of the branch age branches ago, age 0 being the last one and age
+  // length the one that was just shifted out
+  bool bit(uint32_t age) const {
+    if (age < 64) {
+      return (recent >> age) & 1;
+    }
+    return (older[age / 64 - 1] >> (age % 64)) & 1;
+  }
+
+  void push(bool branchWasTaken) {
+    if (!older.empty()) {
+      for (uint32_t i = older.size() - 1; i > 0; i--) {
+        older[i] = (older[i] << 1) | (older[i - 1] >> 63);
+      }
+      older[0] = (older[0] << 1) | (recent >> 63);
+      older.back() &= oldestMask;
+    }
+    recent = ((recent << 1) | branchWasTaken) & recentMask;
+  }
+
+  void serialize(PredictorStateArchive &archive) {
+    archive.value(recent);
+    archive.array(older);
+    recent &= recentMask;
+    if (!older.empty()) {
+      older.back() &= oldestMask;
+    }
+  }
+};
+
+/* A global history folded down to a few bits */
+// Keeps the XOR of the last originalLength outcomes of a GlobalHistoryRegister,
+// cut into pieces of compressedLength bits, up to date in constant time per
+// branch (Seznec and Michaud, "A case for (partially) TAgged GEometric history
+// length branch predictors"). Long histories can then index or tag a table
+// without rehashing all of their bits on every branch.
+//
+class FoldedHistory {
+
+private:
+
+  uint32_t originalLength;
+  uint32_t compressedLength;
+  uint32_t outPosition;
+  uint64_t mask;
+  uint64_t folded;
+
+public:
+
+  FoldedHistory(uint32_t historyLength, uint32_t foldedLength)
+    : originalLength(historyLength),
+      compressedLength(foldedLength),
+      outPosition(foldedLength ? historyLength % foldedLength : 0),
+      mask(historyMaskOf(foldedLength)),
+      folded(0) {}
+
+  uint64_t value() const {
+    return folded;
+  }
+
+  // Call after every GlobalHistoryRegister::push() of a register at least originalLength long
+  void update(const GlobalHistoryRegister &history) {
+    folded = (folded << 1) | history.bit(0);
+    folded ^= (uint64_t)history.bit(originalLength) << outPosition;
+    folded ^= folded >> compressedLength;
+    folded &= mask;
+  }
+
+  void serialize(PredictorStateArchive &archive) {
+    archive.value(folded);
+    folded &= mask;
+  }
+};
+
+/* Base branch predictor class */
+// You are highly recommended to follow this design when implementing your branch predictors
+//
+class BranchPredictorInterface {
+public:
+  virtual ~BranchPredictorInterface() {}
+
+  //This function returns a prediction for a branch instruction with address branchPC
+  virtual bool getPrediction(uint64_t branchPC) = 0;
+  
+  //This function updates branch predictor's history with outcome of branch instruction with address branchPC
+  virtual void train(uint64_t branchPC, bool branchWasTaken) = 0;
+
+  //This function returns a prediction for branch instruction with address branchPC and trains the predictor
+  //with the outcome of that branch. It must behave exactly like getPrediction() followed by train()
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    bool prediction = getPrediction(branchPC);
+    train(branchPC, branchWasTaken);
+    return prediction;
+  }
+
+  //This function saves the tables and histories of the predictor to archive or loads them from it,
+  //whichever direction archive was opened in. Sizes come from the config, they are not part of the state
+  virtual void serialize(PredictorStateArchive &archive) = 0;
+
+  //Every predictor object starts on a cache line, see AllocateCacheAligned()
+  static void *operator new(size_t size) {
+    return AllocateCacheAligned(size);
+  }
+
+  static void operator delete(void *predictor) {
+    FreeCacheAligned(predictor);
+  }
+};
+
+// This is a class which implements always taken branch predictor
+class AlwaysTakenBranchPredictor final : public BranchPredictorInterface {
+public:
+  AlwaysTakenBranchPredictor(const BranchPredictorConfig &config) {}; //no entries here: always taken branch predictor is the simplest predictor
+	virtual bool getPrediction(uint64_t branchPC) {
+		return true; // predict taken
+	}
+	virtual void train(uint64_t branchPC, bool branchWasTaken) {} //nothing to do here: always taken branch predictor does not have history
+	virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+		return true;
+	}
+	virtual void serialize(PredictorStateArchive &archive) {} //nothing to save: always taken branch predictor has no state
+
+	//for DelayedUpdateBranchPredictor: nothing to update later either
+	struct PendingUpdate {};
+	bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+		return true;
+	}
+	void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {}
+	void trainPending(const PendingUpdate &pending, bool branchWasTaken) {}
+};
+
+//------------------------------------------------------------------------------
+//##############################################################################
+
+ //LOCAL PREDICTOR
+class LocalBranchPredictor final : public BranchPredictorInterface {
+ 
+private:
+  
+  uint64_t numEntries;
+ 
+public:
+
+  // the LHT is indexed by the branch PC and holds one history per entry,
+  // the PHT is indexed by that history
+  TableIndexer LHTindex;
+  TableIndexer PHTindex;
+  uint32_t historyMask;
+  CacheAlignedVector<uint32_t> LHR;
+  TwoBitCounterTable PHT;
+
+  LocalBranchPredictor(const BranchPredictorConfig &config)
+    : numEntries(config.numEntries),
+      LHTindex(config.numLHTEntries),
+      PHTindex(config.numEntries),
+      historyMask(historyMaskOf(config.localHistoryBitsOrDefault())),
+      LHR(config.numLHTEntries, 0),
+      PHT(config.numEntries, 0b11) {}
+
+  virtual bool getPrediction(uint64_t branchPC) {
+
+    // the local history of this branch
+    uint32_t history = LHR[LHTindex(branchPC)];
+
+    // our index for PHT
+    uint64_t index = PHTindex(history);
+
+    // if the binary at address is 11 or 10
+    if (PHT.isTaken(index)) { 
+      return true;
+    }
+
+    // else if the value in the PHT is 01 or 00
+    return false;
+  }
+
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+
+    // the local history of this branch
+    uint32_t &history = LHR[LHTindex(branchPC)];
+
+    // our index for PHT
+    uint64_t index = PHTindex(history);
+
+    if (branchWasTaken) {
+
+      // adjust the PHT
+      PHT.increment(index);
+
+      //shift left and add one to LHR
+      history = ((history<<1) + 1) & historyMask;
+
+    }
+    else {
+      
+      // adjust the PHT
+      PHT.decrement(index);
+
+      //shift left and add zero to LHR
+      history = (history<<1) & historyMask;
+    }
+   }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+
+    // the local history of this branch
+    uint32_t &history = LHR[LHTindex(branchPC)];
+
+    // our index for PHT, looked up once for both the prediction and the update
+    bool prediction = PHT.predictAndUpdate(PHTindex(history), branchWasTaken);
+
+    //shift left and add the outcome to LHR
+    history = ((history<<1) + branchWasTaken) & historyMask;
+
+    return prediction;
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    archive.array(LHR);
+    PHT.serialize(archive);
+  }
+
+  // For DelayedUpdateBranchPredictor: the entries a prediction used
+  struct PendingUpdate {
+    uint64_t LHTentry;
+    uint64_t PHTentry;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.LHTentry = LHTindex(branchPC);
+    pending.PHTentry = PHTindex(LHR[pending.LHTentry]);
+    return PHT.isTaken(pending.PHTentry);
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    uint32_t &history = LHR[pending.LHTentry];
+    history = ((history<<1) + branchWasTaken) & historyMask;
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    if (branchWasTaken) {
+      PHT.increment(pending.PHTentry);
+    }
+    else {
+      PHT.decrement(pending.PHTentry);
+    }
+  }
+};
+ 
+// GSHARE PREDICTOR                                                                                                                                          
+class GshareBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  uint64_t numEntries;
+
+public:
+
+  TableIndexer PHTindex;
+  // outcomes of the last globalHistoryBits branches
+  GlobalHistoryRegister GHR;
+  TwoBitCounterTable PHT;
+
+  GshareBranchPredictor(const BranchPredictorConfig &config)
+    : numEntries(config.numEntries),
+      PHTindex(config.numEntries),
+      GHR(config.globalHistoryBitsOrDefault()),
+      PHT(config.numEntries, 0b11) {}
+
+  virtual bool getPrediction(uint64_t branchPC) {
+
+    // our index for PHT                                                                                                                            
+    uint64_t index = PHTindex(branchPC ^ GHR.value());
+
+    // if the binary at address is 11 or 10                                                                                                         
+    if (PHT.isTaken(index)) {
+      return true;
+    }
+
+    // else if the value in the PHT is 01 or 00                                                                                                     
+    return false;
+  }
+
+virtual void train(uint64_t branchPC, bool branchWasTaken) {
+
+    // our index for PHT                                                                                                                             
+    uint64_t index = PHTindex(branchPC ^ GHR.value());
+
+    if (branchWasTaken) {
+
+      // adjust the PHT                                                                                                                              
+      PHT.increment(index);
+
+    }
+    else {
+
+      // adjust the PHT                                                                                                                              
+      PHT.decrement(index);
+    }
+
+    //shift the outcome into GHR
+    GHR.push(branchWasTaken);
+   }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+
+    // our index for PHT, looked up once for both the prediction and the update
+    bool prediction = PHT.predictAndUpdate(PHTindex(branchPC ^ GHR.value()), branchWasTaken);
+
+    //shift the outcome into GHR
+    GHR.push(branchWasTaken);
+
+    return prediction;
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    GHR.serialize(archive);
+    PHT.serialize(archive);
+  }
+
+  // For DelayedUpdateBranchPredictor: the entry a prediction used
+  struct PendingUpdate {
+    uint64_t PHTentry;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.PHTentry = PHTindex(branchPC ^ GHR.value());
+    return PHT.isTaken(pending.PHTentry);
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    GHR.push(branchWasTaken);
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    if (branchWasTaken) {
+      PHT.increment(pending.PHTentry);
+    }
+    else {
+      PHT.decrement(pending.PHTentry);
+    }
+  }
+};
+
+// TOURNAMENT PREDICTOR
+class TournamentBranchPredictor final : public BranchPredictorInterface {
+ 
+private:
+  
+  uint64_t numEntries;
+ 
+public:
+  // held by value: no pointers to follow, and calls into the sub-predictors are not virtual
+  GshareBranchPredictor gbranch;
+  LocalBranchPredictor lbranch;
+  // the chooser table is indexed by the branch PC
+  TableIndexer PHTindex;
+  TwoBitCounterTable PHT;
+
+  // Moves the chooser entry LSB towards the sub-predictor that was right when only
+  // one of them was, and towards the one it chose when both were
+  void trainChooser(uint64_t LSB, bool usedGshare, bool gcorrect, bool lcorrect) {
+    if (usedGshare) {
+      if (! gcorrect && lcorrect) {
+        PHT.decrement(LSB);
+      }
+      else if (gcorrect) {
+        PHT.increment(LSB);
+      }
+      return;
+    }
+
+    if (gcorrect && ! lcorrect) {
+      PHT.increment(LSB);
+    }
+    else if (lcorrect) {
+      PHT.decrement(LSB);
+    }
+  }
+
+  TournamentBranchPredictor(const BranchPredictorConfig &config)
+    : numEntries(config.numEntries),
+      gbranch(config),
+      lbranch(config),
+      PHTindex(config.numEntries),
+      PHT(config.numEntries, 0b11) {}
+
+  virtual bool getPrediction(uint64_t branchPC) {
+
+    // least significant bits
+    uint64_t LSB = PHTindex(branchPC);
+
+    // if the binary at address is 11 or 10 take the gshare prediction
+    if (PHT.isTaken(LSB)) { 
+      return gbranch.getPrediction(branchPC);
+    }
+
+    // else if the value in the PHT is 01 or 00 take the local predictor
+    return lbranch.getPrediction(branchPC);
+  }
+
+  // The chooser has not changed since getPrediction(), so which predictor was
+  // used is read from it again instead of being remembered in between
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    predictAndTrain(branchPC, branchWasTaken);
+  }
+
+  // Each sub-predictor is queried and trained exactly once, and the chooser
+  // moves towards the sub-predictor that was right when only one of them was
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+
+    // least significant bits
+    uint64_t LSB = PHTindex(branchPC);
+
+    // if the binary at address is 11 or 10 take the gshare prediction
+    bool usedGshare = PHT.isTaken(LSB);
+
+    bool gresult = gbranch.predictAndTrain(branchPC, branchWasTaken);
+    bool lresult = lbranch.predictAndTrain(branchPC, branchWasTaken);
+
+    trainChooser(LSB, usedGshare, gresult == branchWasTaken, lresult == branchWasTaken);
+    return usedGshare ? gresult : lresult;
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    gbranch.serialize(archive);
+    lbranch.serialize(archive);
+    PHT.serialize(archive);
+  }
+
+  // For DelayedUpdateBranchPredictor: what both sub-predictors and the chooser
+  // used, and what the sub-predictors predicted. Both sub-predictors shift the
+  // actual outcome into their histories
+  struct PendingUpdate {
+    GshareBranchPredictor::PendingUpdate gshare;
+    LocalBranchPredictor::PendingUpdate local;
+    uint64_t LSB;
+    bool usedGshare;
+    bool gresult;
+    bool lresult;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.LSB = PHTindex(branchPC);
+    pending.usedGshare = PHT.isTaken(pending.LSB);
+    pending.gresult = gbranch.predictPending(branchPC, pending.gshare);
+    pending.lresult = lbranch.predictPending(branchPC, pending.local);
+    return pending.usedGshare ? pending.gresult : pending.lresult;
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    gbranch.updateHistory(pending.gshare, branchWasTaken);
+    lbranch.updateHistory(pending.local, branchWasTaken);
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    gbranch.trainPending(pending.gshare, branchWasTaken);
+    lbranch.trainPending(pending.local, branchWasTaken);
+    trainChooser(pending.LSB, pending.usedGshare, pending.gresult == branchWasTaken, pending.lresult == branchWasTaken);
+  }
+};
+
+// TAGE PREDICTOR
+// A bimodal base table backed by TAGE_TABLES tagged tables indexed with global
+// histories of geometrically increasing length (Seznec and Michaud, "A case for
+// (partially) TAgged GEometric history length branch predictors"). The longest
+// history whose tag matches provides the prediction. The histories are folded
+// incrementally on every branch, and all state is allocated in the constructor.
+// An entry of a tagged table is 4 bytes (tag, 3-bit counter, 2-bit useful
+// counter), so a lookup touches a single cache line per table.
+class TageBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  static const uint32_t TAGE_TABLES        = 7;
+  static const uint32_t MIN_HISTORY_LENGTH = 4;
+  static const uint32_t USEFUL_RESET_LOG   = 18;  // useful counters age every 2^18 branches
+
+  struct TaggedEntry {
+    uint16_t tag;
+    int8_t counter;   // -4..3, predicts taken when >= 0
+    uint8_t useful;   // 0..3
+  };
+
+  // what a lookup found for the current branch
+  struct Lookup {
+    uint64_t index[TAGE_TABLES];
+    uint16_t tag[TAGE_TABLES];
+    uint64_t baseIndex;
+    int32_t provider;     // table of the longest matching history, -1 for the base table
+    int32_t alternate;    // next longest match, -1 for the base table
+    bool providerPrediction;
+    bool alternatePrediction;
+    bool prediction;
+  };
+
+  uint64_t numEntries;
+  uint32_t logTaggedEntries;
+  uint32_t historyLength[TAGE_TABLES];
+  uint32_t tagBits[TAGE_TABLES];
+
+  TableIndexer baseIndexer;
+  TwoBitCounterTable base;
+  CacheAlignedVector<TaggedEntry> tagged;   // the tables one after the other
+  GlobalHistoryRegister GHR;
+  std::vector<FoldedHistory> indexHistory;
+  std::vector<FoldedHistory> tagHistory;
+  std::vector<FoldedHistory> tagHistoryShifted;
+
+  int32_t useAlternateOnNew;   // 4-bit signed: trust alternate over newly allocated entries when >= 0
+  uint64_t branchCount;
+  uint64_t randomState;
+
+  TaggedEntry &entry(uint32_t table, uint64_t index) {
+    return tagged[((uint64_t)table << logTaggedEntries) + index];
+  }
+
+  const TaggedEntry &entry(uint32_t table, uint64_t index) const {
+    return tagged[((uint64_t)table << logTaggedEntries) + index];
+  }
+
+  static bool isWeak(const TaggedEntry &e) {
+    return e.counter == 0 || e.counter == -1;
+  }
+
+  void lookup(uint64_t branchPC, Lookup &found) const {
+    uint64_t indexMask = (1ULL << logTaggedEntries) - 1;
+    found.baseIndex = baseIndexer(branchPC);
+    found.provider = -1;
+    found.alternate = -1;
+    for (uint32_t i = 0; i < TAGE_TABLES; i++) {
+      found.index[i] = (branchPC ^ (branchPC >> logTaggedEntries) ^ indexHistory[i].value()) & indexMask;
+      found.tag[i] = (branchPC ^ tagHistory[i].value() ^ (tagHistoryShifted[i].value() << 1)) & ((1U << tagBits[i]) - 1);
+    }
+    for (int32_t i = TAGE_TABLES - 1; i >= 0; i--) {
+      if (entry(i, found.index[i]).tag == found.tag[i]) {
+        if (found.provider < 0) {
+          found.provider = i;
+        }
+        else {
+          found.alternate = i;
+          break;
+        }
+      }
+    }
+
+    bool basePrediction = base.isTaken(found.baseIndex);
+    found.alternatePrediction = found.alternate >= 0 ? entry(found.alternate, found.index[found.alternate]).counter >= 0 : basePrediction;
+    if (found.provider < 0) {
+      found.providerPrediction = basePrediction;
+      found.prediction = basePrediction;
+      return;
+    }
+    const TaggedEntry &provider = entry(found.provider, found.index[found.provider]);
+    found.providerPrediction = provider.counter >= 0;
+    // a newly allocated entry has not proven itself yet
+    bool newEntry = isWeak(provider) && provider.useful == 0;
+    found.prediction = newEntry && useAlternateOnNew >= 0 ? found.alternatePrediction : found.providerPrediction;
+  }
+
+  // Trains the tables on the branch whose lookup() found found
+  void updateTables(const Lookup &found, bool branchWasTaken) {
+    if (found.provider >= 0) {
+      TaggedEntry &provider = entry(found.provider, found.index[found.provider]);
+      bool newEntry = isWeak(provider) && provider.useful == 0;
+      if (newEntry && found.providerPrediction != found.alternatePrediction) {
+        bool alternateCorrect = found.alternatePrediction == branchWasTaken;
+        if (alternateCorrect && useAlternateOnNew < 7) {
+          useAlternateOnNew++;
+        }
+        else if (!alternateCorrect && useAlternateOnNew > -8) {
+          useAlternateOnNew--;
+        }
+      }
+    }
+
+    // allocate an entry with a longer history on a misprediction
+    if (found.prediction != branchWasTaken && found.provider < (int32_t)TAGE_TABLES - 1) {
+      // start one table further now and then, so that not always the shortest free one is taken
+      randomState ^= randomState << 13;
+      randomState ^= randomState >> 7;
+      randomState ^= randomState << 17;
+      uint32_t first = found.provider + 1 + ((randomState & 3) == 0);
+      if (first >= TAGE_TABLES) {
+        first = found.provider + 1;
+      }
+      bool allocated = false;
+      for (uint32_t i = first; i < TAGE_TABLES; i++) {
+        TaggedEntry &e = entry(i, found.index[i]);
+        if (e.useful == 0) {
+          e.tag = found.tag[i];
+          e.counter = branchWasTaken ? 0 : -1;
+          allocated = true;
+          break;
+        }
+      }
+      if (!allocated) {
+        for (uint32_t i = found.provider + 1; i < TAGE_TABLES; i++) {
+          TaggedEntry &e = entry(i, found.index[i]);
+          if (e.useful > 0) {
+            e.useful--;
+          }
+        }
+      }
+    }
+
+    // train the provider, and the base table when it provided or the provider is still new
+    if (found.provider >= 0) {
+      TaggedEntry &provider = entry(found.provider, found.index[found.provider]);
+      if (provider.useful == 0 && found.alternate < 0) {
+        base.predictAndUpdate(found.baseIndex, branchWasTaken);
+      }
+      if (branchWasTaken && provider.counter < 3) {
+        provider.counter++;
+      }
+      else if (!branchWasTaken && provider.counter > -4) {
+        provider.counter--;
+      }
+      if (found.providerPrediction != found.alternatePrediction) {
+        if (found.providerPrediction == branchWasTaken && provider.useful < 3) {
+          provider.useful++;
+        }
+        else if (found.providerPrediction != branchWasTaken && provider.useful > 0) {
+          provider.useful--;
+        }
+      }
+    }
+    else {
+      base.predictAndUpdate(found.baseIndex, branchWasTaken);
+    }
+
+    // let the useful counters age, clearing their high and low bits in turn
+    if ((++branchCount & ((1ULL << USEFUL_RESET_LOG) - 1)) == 0) {
+      uint8_t keep = (branchCount >> USEFUL_RESET_LOG) & 1 ? 1 : 2;
+      for (uint64_t i = 0; i < tagged.size(); i++) {
+        tagged[i].useful &= keep;
+      }
+    }
+  }
+
+  void pushHistory(bool branchWasTaken) {
+    GHR.push(branchWasTaken);
+    for (uint32_t i = 0; i < TAGE_TABLES; i++) {
+      indexHistory[i].update(GHR);
+      tagHistory[i].update(GHR);
+      tagHistoryShifted[i].update(GHR);
+    }
+  }
+
+  void update(const Lookup &found, bool branchWasTaken) {
+    updateTables(found, branchWasTaken);
+    pushHistory(branchWasTaken);
+  }
+
+public:
+
+  TageBranchPredictor(const BranchPredictorConfig &config)
+    : numEntries(config.numEntries),
+      // the tagged tables together hold about as many entries as the base table, at least 16 each
+      logTaggedEntries(BranchPredictorConfig::ceilLog2(config.numEntries) > 6 ? BranchPredictorConfig::ceilLog2(config.numEntries) - 2 : 4),
+      baseIndexer(config.numEntries),
+      base(config.numEntries, 0b10),
+      tagged((uint64_t)TAGE_TABLES << logTaggedEntries),
+      GHR(config.globalHistoryBitsOrDefault()),
+      useAlternateOnNew(0),
+      branchCount(0),
+      randomState(0x9e3779b97f4a7c15ULL) {
+    // geometric series of history lengths from MIN_HISTORY_LENGTH to global_history_bits
+    double maxLength = std::max<uint32_t>(config.globalHistoryBitsOrDefault(), MIN_HISTORY_LENGTH + TAGE_TABLES);
+    for (uint32_t i = 0; i < TAGE_TABLES; i++) {
+      double ratio = std::pow(maxLength / MIN_HISTORY_LENGTH, (double)i / (TAGE_TABLES - 1));
+      historyLength[i] = std::min<uint32_t>((uint32_t)(MIN_HISTORY_LENGTH * ratio + 0.5), GHR.size());
+      tagBits[i] = std::min<uint32_t>(8 + i, 15);
+      indexHistory.push_back(FoldedHistory(historyLength[i], logTaggedEntries));
+      tagHistory.push_back(FoldedHistory(historyLength[i], tagBits[i]));
+      tagHistoryShifted.push_back(FoldedHistory(historyLength[i], tagBits[i] - 1));
+    }
+    TaggedEntry empty = {0, 0, 0};
+    std::fill(tagged.begin(), tagged.end(), empty);
+  }
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    Lookup found;
+    lookup(branchPC, found);
+    return found.prediction;
+  }
+
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    Lookup found;
+    lookup(branchPC, found);
+    update(found, branchWasTaken);
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    Lookup found;
+    lookup(branchPC, found);
+    update(found, branchWasTaken);
+    return found.prediction;
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    base.serialize(archive);
+    archive.array(tagged);
+    GHR.serialize(archive);
+    for (uint32_t i = 0; i < TAGE_TABLES; i++) {
+      indexHistory[i].serialize(archive);
+      tagHistory[i].serialize(archive);
+      tagHistoryShifted[i].serialize(archive);
+    }
+    archive.value(useAlternateOnNew);
+    archive.value(branchCount);
+    archive.value(randomState);
+  }
+
+  // For DelayedUpdateBranchPredictor: the whole lookup, so that the update
+  // allocates with the indices and tags of the histories at prediction time
+  typedef Lookup PendingUpdate;
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    lookup(branchPC, pending);
+    return pending.prediction;
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    pushHistory(branchWasTaken);
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    updateTables(pending, branchWasTaken);
+  }
+};
+
+// PERCEPTRON PREDICTOR
+// One perceptron per table entry, selected by the branch PC, with an int8 weight
+// for each of the last global_history_bits outcomes and a bias weight (Jimenez
+// and Lin, "Dynamic branch prediction with perceptrons"). The outcomes are kept
+// as +1 / -1 bytes in a circular buffer that is written twice, at pos and at
+// pos + historyBits, so the whole history is always one contiguous window and
+// the dot product and the training update are plain loops over bytes. With AVX2
+// they process 32 weights at a time; each row is padded to a multiple of 32 and
+// a mask zeroes the history bytes beyond global_history_bits. Weights saturate
+// at +-127, so that negating one never overflows. With an update delay the
+// buffer is update_delay outcomes longer, so that the window a prediction used
+// is still there when its update comes.
+class PerceptronBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  static const uint32_t VECTOR_BYTES = 32;
+
+  TableIndexer rowIndexer;
+  uint32_t historyBits;
+  uint32_t bufferLength;        // historyBits plus the update delay
+  uint32_t rowBytes;            // historyBits rounded up to VECTOR_BYTES
+  int32_t threshold;
+  CacheAlignedVector<int8_t> weights;  // one row of rowBytes per perceptron
+  CacheAlignedVector<int8_t> bias;
+  CacheAlignedVector<int8_t> history;  // 2 * bufferLength + VECTOR_BYTES bytes
+  CacheAlignedVector<int8_t> historyMask;
+  uint32_t pos;
+
+  const int8_t *window(uint32_t position) const {
+    return &history[position];
+  }
+
+  int32_t output(uint64_t row) const {
+    const int8_t *w = &weights[row * rowBytes];
+    const int8_t *x = window(pos);
+    int32_t sum = bias[row];
+#ifdef __AVX2__
+    const __m256i ones8 = _mm256_set1_epi8(1);
+    const __m256i ones16 = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (uint32_t i = 0; i < rowBytes; i += VECTOR_BYTES) {
+      __m256i xv = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(x + i)), _mm256_loadu_si256((const __m256i *)&historyMask[i]));
+      __m256i products = _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *)(w + i)), xv);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(ones8, products), ones16));
+    }
+    alignas(32) int32_t lanes[8];
+    _mm256_store_si256((__m256i *)lanes, acc);
+    for (uint32_t k = 0; k < 8; k++) {
+      sum += lanes[k];
+    }
+#else
+    for (uint32_t i = 0; i < historyBits; i++) {
+      sum += w[i] * x[i];
+    }
+#endif
+    return sum;
+  }
+
+  static int8_t saturate(int32_t weight) {
+    return weight > 127 ? 127 : weight < -127 ? -127 : weight;
+  }
+
+  // Trains the perceptron of row, whose output was y for the history window at position
+  void trainWeights(uint64_t row, int32_t y, uint32_t position, bool branchWasTaken) {
+    // train on a misprediction or when the output was not confident enough
+    if ((y >= 0) != branchWasTaken || std::abs(y) <= threshold) {
+      int8_t *w = &weights[row * rowBytes];
+      const int8_t *x = window(position);
+      bias[row] = saturate(bias[row] + (branchWasTaken ? 1 : -1));
+#ifdef __AVX2__
+      const __m256i minWeight = _mm256_set1_epi8(-127);
+      for (uint32_t i = 0; i < rowBytes; i += VECTOR_BYTES) {
+        __m256i xv = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(x + i)), _mm256_loadu_si256((const __m256i *)&historyMask[i]));
+        __m256i wv = _mm256_loadu_si256((const __m256i *)(w + i));
+        wv = branchWasTaken ? _mm256_adds_epi8(wv, xv) : _mm256_subs_epi8(wv, xv);
+        _mm256_storeu_si256((__m256i *)(w + i), _mm256_max_epi8(wv, minWeight));
+      }
+#else
+      for (uint32_t i = 0; i < historyBits; i++) {
+        w[i] = saturate(w[i] + (branchWasTaken ? x[i] : -x[i]));
+      }
+#endif
+    }
+  }
+
+  void pushHistory(bool branchWasTaken) {
+    // the newest outcome goes in front of the window
+    pos = pos == 0 ? bufferLength - 1 : pos - 1;
+    history[pos] = history[pos + bufferLength] = branchWasTaken ? 1 : -1;
+  }
+
+  void update(uint64_t row, int32_t y, bool branchWasTaken) {
+    trainWeights(row, y, pos, branchWasTaken);
+    pushHistory(branchWasTaken);
+  }
+
+public:
+
+  PerceptronBranchPredictor(const BranchPredictorConfig &config)
+    : rowIndexer(config.numEntries),
+      historyBits(config.globalHistoryBitsOrDefault()),
+      bufferLength(historyBits + config.updateDelay),
+      rowBytes((historyBits + VECTOR_BYTES - 1) / VECTOR_BYTES * VECTOR_BYTES),
+      // the training threshold found best by Jimenez and Lin
+      threshold((int32_t)(1.93 * historyBits + 14)),
+      weights(config.numEntries * rowBytes, 0),
+      bias(config.numEntries, 0),
+      history(2 * bufferLength + VECTOR_BYTES, -1),
+      historyMask(rowBytes, 0),
+      pos(0) {
+    std::fill(historyMask.begin(), historyMask.begin() + historyBits, -1);
+  }
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    return output(rowIndexer(branchPC)) >= 0;
+  }
+
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    uint64_t row = rowIndexer(branchPC);
+    update(row, output(row), branchWasTaken);
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    uint64_t row = rowIndexer(branchPC);
+    int32_t y = output(row);
+    update(row, y, branchWasTaken);
+    return y >= 0;
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    archive.array(weights);
+    archive.array(bias);
+    archive.array(history);
+    archive.value(pos);
+    if (pos >= bufferLength) {
+      pos = 0;
+    }
+  }
+
+  // For DelayedUpdateBranchPredictor: the perceptron, its output and the history
+  // window it was computed from
+  struct PendingUpdate {
+    uint64_t row;
+    int32_t output;
+    uint32_t pos;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.row = rowIndexer(branchPC);
+    pending.output = output(pending.row);
+    pending.pos = pos;
+    return pending.output >= 0;
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    pushHistory(branchWasTaken);
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    trainWeights(pending.row, pending.output, pending.pos, branchWasTaken);
+  }
+};
+
+// HYBRID PREDICTOR
+// Any number of components, listed in config.hybridComponents separated by '+'
+// (e.g. "local+gshare+perceptron") and all built from the same sizes. A chooser
+// entry, selected by the branch PC XOR the last chooserHistoryBits outcomes, has
+// a 2-bit confidence counter per component, and the most confident component
+// (the first one on a tie) provides the prediction. When the components
+// disagree, the counters of those that were right go up and the others go down.
+// The set of components is only known at run time, so they are called
+// virtually; the two-component TournamentBranchPredictor keeps its children by
+// value instead. The components are built one after the other in a single
+// cache-aligned arena, each on its own cache lines, rather than in a heap block
+// each.
+class HybridBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  char *arena;
+  std::vector<BranchPredictorInterface *> components;   // in arena
+  TableIndexer chooserIndex;
+  GlobalHistoryRegister chooserHistory;
+  CacheAlignedVector<uint8_t> confidence;    // components.size() counters per chooser entry
+  std::vector<uint8_t> predictions;   // of every component for the current branch
+
+  uint32_t choose(uint64_t entry) const {
+    const uint8_t *counters = &confidence[entry * components.size()];
+    uint32_t chosen = 0;
+    for (uint32_t i = 1; i < components.size(); i++) {
+      if (counters[i] > counters[chosen]) {
+        chosen = i;
+      }
+    }
+    return chosen;
+  }
+
+public:
+
+  // defined after CreateBranchPredictorOfType(), which builds the components
+  HybridBranchPredictor(const BranchPredictorConfig &config);
+
+  HybridBranchPredictor(const HybridBranchPredictor &) = delete;
+  HybridBranchPredictor &operator=(const HybridBranchPredictor &) = delete;
+
+  virtual ~HybridBranchPredictor() {
+    for (uint32_t i = 0; i < components.size(); i++) {
+      components[i]->~BranchPredictorInterface();
+    }
+    FreeCacheAligned(arena);
+  }
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    uint64_t entry = chooserIndex(branchPC ^ chooserHistory.value());
+    return components[choose(entry)]->getPrediction(branchPC);
+  }
+
+  // The chooser has not changed since getPrediction(), so the component that was
+  // used is found again instead of being remembered in between
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    predictAndTrain(branchPC, branchWasTaken);
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    uint64_t entry = chooserIndex(branchPC ^ chooserHistory.value());
+    uint32_t chosen = choose(entry);
+
+    // every component is queried and trained exactly once
+    uint32_t correctCount = 0;
+    for (uint32_t i = 0; i < components.size(); i++) {
+      predictions[i] = components[i]->predictAndTrain(branchPC, branchWasTaken);
+      correctCount += predictions[i] == branchWasTaken;
+    }
+
+    if (correctCount != 0 && correctCount != components.size()) {
+      uint8_t *counters = &confidence[entry * components.size()];
+      for (uint32_t i = 0; i < components.size(); i++) {
+        if (predictions[i] == branchWasTaken) {
+          counters[i] += counters[i] < 3;
+        }
+        else {
+          counters[i] -= counters[i] > 0;
+        }
+      }
+    }
+
+    chooserHistory.push(branchWasTaken);
+    return predictions[chosen];
+  }
+
+  virtual void serialize(PredictorStateArchive &archive) {
+    for (uint32_t i = 0; i < components.size(); i++) {
+      components[i]->serialize(archive);
+    }
+    archive.array(confidence);
+    chooserHistory.serialize(archive);
+  }
+};
+
+//##############################################################################
+//------------------------------------------------------------------------------
+
+/* Predictors specialized for one size at compile time */
+// StaticGshareBranchPredictor and StaticLocalBranchPredictor behave exactly like
+// GshareBranchPredictor and LocalBranchPredictor with power-of-two tables, but the
+// table sizes and history lengths are template parameters. The masks are
+// constants the compiler folds into the index math, and the tables are arrays
+// inside the object rather than behind a pointer. CreateBranchPredictorOfType()
+// picks one of the sizes instantiated in StaticPredictorSizes when the options
+// ask for it, and the runtime sized classes otherwise.
+//
+template <uint32_t logEntries, uint32_t historyBits>
+class StaticGshareBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  static constexpr uint64_t NUM_ENTRIES  = 1ULL << logEntries;
+  static constexpr uint64_t INDEX_MASK   = NUM_ENTRIES - 1;
+  static constexpr uint64_t HISTORY_MASK = (1ULL << historyBits) - 1;
+
+  uint64_t GHR = 0;
+  FixedTwoBitCounterTable<NUM_ENTRIES> PHT;
+
+public:
+
+  StaticGshareBranchPredictor(const BranchPredictorConfig &config) : PHT(NUM_ENTRIES, 0b11) {}
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    return PHT.isTaken((branchPC ^ GHR) & INDEX_MASK);
+  }
+
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    uint64_t index = (branchPC ^ GHR) & INDEX_MASK;
+    if (branchWasTaken) {
+      PHT.increment(index);
+    }
+    else {
+      PHT.decrement(index);
+    }
+    GHR = ((GHR<<1) + branchWasTaken) & HISTORY_MASK;
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    uint64_t index = (branchPC ^ GHR) & INDEX_MASK;
+    bool prediction = PHT.predictAndUpdate(index, branchWasTaken);
+    GHR = ((GHR<<1) + branchWasTaken) & HISTORY_MASK;
+    return prediction;
+  }
+
+  // in the layout of GshareBranchPredictor, whose history register has no older words at these lengths
+  virtual void serialize(PredictorStateArchive &archive) {
+    std::array<uint64_t, 0> olderHistory;
+    archive.value(GHR);
+    archive.array(olderHistory);
+    GHR &= HISTORY_MASK;
+    PHT.serialize(archive);
+  }
+
+  struct PendingUpdate {
+    uint64_t PHTentry;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.PHTentry = (branchPC ^ GHR) & INDEX_MASK;
+    return PHT.isTaken(pending.PHTentry);
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    GHR = ((GHR<<1) + branchWasTaken) & HISTORY_MASK;
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    if (branchWasTaken) {
+      PHT.increment(pending.PHTentry);
+    }
+    else {
+      PHT.decrement(pending.PHTentry);
+    }
+  }
+};
+
+template <uint32_t lhtBits, uint32_t historyBits, uint32_t phtBits>
+class StaticLocalBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  static constexpr uint64_t NUM_LHT_ENTRIES = 1ULL << lhtBits;
+  static constexpr uint64_t NUM_ENTRIES     = 1ULL << phtBits;
+  static constexpr uint64_t LHT_MASK        = NUM_LHT_ENTRIES - 1;
+  static constexpr uint64_t PHT_MASK        = NUM_ENTRIES - 1;
+  static constexpr uint32_t HISTORY_MASK    = (uint32_t)((1ULL << historyBits) - 1);
+
+  std::array<uint32_t, NUM_LHT_ENTRIES> LHR;
+  FixedTwoBitCounterTable<NUM_ENTRIES> PHT;
+
+public:
+
+  StaticLocalBranchPredictor(const BranchPredictorConfig &config) : PHT(NUM_ENTRIES, 0b11) {
+    LHR.fill(0);
+  }
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    return PHT.isTaken(LHR[branchPC & LHT_MASK] & PHT_MASK);
+  }
+
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    uint32_t &history = LHR[branchPC & LHT_MASK];
+    if (branchWasTaken) {
+      PHT.increment(history & PHT_MASK);
+    }
+    else {
+      PHT.decrement(history & PHT_MASK);
+    }
+    history = ((history<<1) + branchWasTaken) & HISTORY_MASK;
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    uint32_t &history = LHR[branchPC & LHT_MASK];
+    bool prediction = PHT.predictAndUpdate(history & PHT_MASK, branchWasTaken);
+    history = ((history<<1) + branchWasTaken) & HISTORY_MASK;
+    return prediction;
+  }
+
+  // in the layout of LocalBranchPredictor
+  virtual void serialize(PredictorStateArchive &archive) {
+    archive.array(LHR);
+    PHT.serialize(archive);
+  }
+
+  struct PendingUpdate {
+    uint64_t LHTentry;
+    uint64_t PHTentry;
+  };
+
+  bool predictPending(uint64_t branchPC, PendingUpdate &pending) const {
+    pending.LHTentry = branchPC & LHT_MASK;
+    pending.PHTentry = LHR[pending.LHTentry] & PHT_MASK;
+    return PHT.isTaken(pending.PHTentry);
+  }
+
+  void updateHistory(const PendingUpdate &pending, bool branchWasTaken) {
+    uint32_t &history = LHR[pending.LHTentry];
+    history = ((history<<1) + branchWasTaken) & HISTORY_MASK;
+  }
+
+  void trainPending(const PendingUpdate &pending, bool branchWasTaken) {
+    if (branchWasTaken) {
+      PHT.increment(pending.PHTentry);
+    }
+    else {
+      PHT.decrement(pending.PHTentry);
+    }
+  }
+};
+
+/* The sizes for which specialized predictors are compiled */
+// Tables of 2^minLogEntries to 2^maxLogEntries entries with the default history
+// length (log2 of the table size); the local predictor also needs the default
+// LHT of 2^lhtBits entries. Anything else uses the runtime sized classes.
+//
+template <uint32_t minLogEntries, uint32_t maxLogEntries, uint32_t lhtBits = 7, bool empty = (minLogEntries > maxLogEntries)>
+struct StaticPredictorSizes {
+
+  template <class Factory>
+  static bool createGshare(const BranchPredictorConfig &config, Factory &factory) {
+    if (config.numEntries == (1ULL << minLogEntries) && config.globalHistoryBitsOrDefault() == minLogEntries) {
+      factory.template create<StaticGshareBranchPredictor<minLogEntries, minLogEntries> >();
+      return true;
+    }
+    return StaticPredictorSizes<minLogEntries + 1, maxLogEntries, lhtBits>::createGshare(config, factory);
+  }
+
+  template <class Factory>
+  static bool createLocal(const BranchPredictorConfig &config, Factory &factory) {
+    if (config.numEntries == (1ULL << minLogEntries) && config.localHistoryBitsOrDefault() == minLogEntries &&
+        config.numLHTEntries == (1ULL << lhtBits)) {
+      factory.template create<StaticLocalBranchPredictor<lhtBits, minLogEntries, minLogEntries> >();
+      return true;
+    }
+    return StaticPredictorSizes<minLogEntries + 1, maxLogEntries, lhtBits>::createLocal(config, factory);
+  }
+};
+
+template <uint32_t minLogEntries, uint32_t maxLogEntries, uint32_t lhtBits>
+struct StaticPredictorSizes<minLogEntries, maxLogEntries, lhtBits, true> {
+
+  template <class Factory>
+  static bool createGshare(const BranchPredictorConfig &, Factory &) {
+    return false;
+  }
+
+  template <class Factory>
+  static bool createLocal(const BranchPredictorConfig &, Factory &) {
+    return false;
+  }
+};
+
+// 1K to 64K entries, the table sizes usually simulated
+typedef StaticPredictorSizes<10, 16> CommonStaticPredictorSizes;
+
+/* A predictor whose tables learn the outcome of a branch some branches later */
+// Models a pipeline that predicts a conditional branch at fetch but only trains
+// the tables when the branch retires, config.updateDelay branches later, so every
+// prediction comes from tables that have not seen the branches still in flight.
+// The histories are never speculative: the tool only sees the correct path, so
+// each branch shifts its actual outcome into them right after its prediction,
+// as if a misprediction were repaired before the next branch is fetched. Only the
+// table updates wait their turn.
+//
+// Predictor provides a PendingUpdate, holding whatever a prediction looked at
+// that the update needs later, and three calls on it: predictPending() predicts
+// without changing anything, updateHistory() shifts the outcome into the
+// histories and trainPending() trains the tables. HybridBranchPredictor has no
+// PendingUpdate, as its components are only known at run time, so it cannot be
+// combined with -update_delay. With an updateDelay of 0 this behaves exactly
+// like Predictor. The branches in flight are a ring buffer allocated in the
+// constructor, and nothing is called virtually.
+//
+template <class Predictor>
+class DelayedUpdateBranchPredictor final : public BranchPredictorInterface {
+
+private:
+
+  struct InFlightBranch {
+    typename Predictor::PendingUpdate pending;
+    bool taken;
+  };
+
+  Predictor predictor;
+  CacheAlignedVector<InFlightBranch> inFlight;   // updateDelay entries, the oldest branch at inFlight[next] once full
+  uint32_t next;
+  uint32_t numInFlight;
+
+public:
+
+  DelayedUpdateBranchPredictor(const BranchPredictorConfig &config)
+    : predictor(config), inFlight(config.updateDelay), next(0), numInFlight(0) {}
+
+  virtual bool getPrediction(uint64_t branchPC) {
+    typename Predictor::PendingUpdate pending;
+    return predictor.Predictor::predictPending(branchPC, pending);
+  }
+
+  // A pipeline step needs the prediction again, so it is made once more here
+  virtual void train(uint64_t branchPC, bool branchWasTaken) {
+    predictAndTrain(branchPC, branchWasTaken);
+  }
+
+  virtual bool predictAndTrain(uint64_t branchPC, bool branchWasTaken) {
+    typename Predictor::PendingUpdate pending;
+    bool prediction = predictor.Predictor::predictPending(branchPC, pending);
+
+    // the update comes before the histories move, so that at most updateDelay
+    // outcomes were shifted in since the prediction it belongs to
+    if (inFlight.empty()) {
+      predictor.Predictor::trainPending(pending, branchWasTaken);
+    }
+    else {
+      // the branch updateDelay branches back retires and leaves its slot to this one
+      InFlightBranch &branch = inFlight[next];
+      if (numInFlight == inFlight.size()) {
+        predictor.Predictor::trainPending(branch.pending, branch.taken);
+      }
+      else {
+        numInFlight++;
+      }
+      branch.pending = pending;
+      branch.taken = branchWasTaken;
+      next = next + 1 == inFlight.size() ? 0 : next + 1;
+    }
+
+    predictor.Predictor::updateHistory(pending, branchWasTaken);
+    return prediction;
+  }
+
+  // Only the state of Predictor: a loaded predictor starts with an empty pipeline
+  virtual void serialize(PredictorStateArchive &archive) {
+    predictor.Predictor::serialize(archive);
+    if (archive.loading()) {
+      next = 0;
+      numInFlight = 0;
+    }
+  }
+};
+
+
+/* A conditional branch and its outcome */
+//
+struct BranchEvent {
+  uint64_t pc;
+  bool taken;
+};
+
+/* Counters kept for each simulated branch predictor */
+//
+struct BranchPredictorStats {
+  uint64_t correctPredictionCount          = 0;
+  uint64_t predictedTakenBranchesCount     = 0;
+  uint64_t predictedNotTakenBranchesCount  = 0;
+
+  void record(bool wasPredictedTaken, bool branchWasTaken) {
+    // Count the number of conditional branches predicted taken and not-taken
+    if (wasPredictedTaken) {
+      predictedTakenBranchesCount++;
+    } else {
+      predictedNotTakenBranchesCount++;
+    }
+
+    // Count the number of correct predictions
+    if (wasPredictedTaken == branchWasTaken)
+      correctPredictionCount++;
+  }
+
+  void merge(const BranchPredictorStats &other) {
+    correctPredictionCount         += other.correctPredictionCount;
+    predictedTakenBranchesCount    += other.predictedTakenBranchesCount;
+    predictedNotTakenBranchesCount += other.predictedNotTakenBranchesCount;
+  }
+};
+
+/* Counters of a stream of branches, independent of any predictor */
+//
+struct BranchStreamStats {
+  uint64_t conditionalBranchesCount = 0;
+  uint64_t takenBranchesCount       = 0;
+  uint64_t notTakenBranchesCount    = 0;
+
+  void record(bool branchWasTaken) {
+    // Count the number of conditional branches executed
+    conditionalBranchesCount++;
+
+    // Count the number of conditional branches actually taken and not-taken
+    if (branchWasTaken) {
+      takenBranchesCount++;
+    } else {
+      notTakenBranchesCount++;
+    }
+  }
+
+  void merge(const BranchStreamStats &other) {
+    conditionalBranchesCount += other.conditionalBranchesCount;
+    takenBranchesCount       += other.takenBranchesCount;
+    notTakenBranchesCount    += other.notTakenBranchesCount;
+  }
+};
+
+/* Counters of one predictor for every branch PC, in an open-addressing hash table */
+// The table is allocated once with room for capacity branches and never grows, so
+// recording a branch does not allocate: branches found once the table is full are
+// only counted in untrackedExecutions. Twice as many slots as branches keep the
+// linear probes short; a slot with no executions is empty.
+//
+class BranchProfile {
+
+public:
+
+  struct Entry {
+    uint64_t pc;
+    uint64_t executions;
+    uint64_t mispredictions;
+    uint64_t taken;
+  };
+
+private:
+
+  CacheAlignedVector<Entry> slots;
+  uint64_t slotMask;
+  uint64_t capacity;
+  uint64_t used;
+  uint64_t untrackedExecutions;
+
+  // Returns the slot of pc, claiming an empty one for it if there is room, or NULL
+  Entry *find(uint64_t pc) {
+    // Fibonacci hashing spreads PCs that differ only in their low bits
+    uint64_t slot = ((pc * 0x9e3779b97f4a7c15ULL) >> 32) & slotMask;
+    for (;;) {
+      Entry &entry = slots[slot];
+      if (entry.executions == 0) {
+        if (used == capacity) {
+          return NULL;
+        }
+        used++;
+        entry.pc = pc;
+        return &entry;
+      }
+      if (entry.pc == pc) {
+        return &entry;
+      }
+      slot = (slot + 1) & slotMask;
+    }
+  }
+
+  void add(uint64_t pc, uint64_t executions, uint64_t mispredictions, uint64_t taken) {
+    Entry *entry = find(pc);
+    if (entry == NULL) {
+      untrackedExecutions += executions;
+      return;
+    }
+    entry->executions     += executions;
+    entry->mispredictions += mispredictions;
+    entry->taken          += taken;
+  }
+
+public:
+
+  BranchProfile(uint64_t numberOfBranches) : capacity(numberOfBranches), used(0), untrackedExecutions(0) {
+    uint64_t numSlots = 1;
+    while (numSlots < 2 * capacity) {
+      numSlots <<= 1;
+    }
+    Entry empty = {0, 0, 0, 0};
+    slots.assign(numSlots, empty);
+    slotMask = numSlots - 1;
+  }
+
+  void record(uint64_t branchPC, bool wasPredictedTaken, bool branchWasTaken) {
+    add(branchPC, 1, wasPredictedTaken != branchWasTaken, branchWasTaken);
+  }
+
+  void merge(const BranchProfile &other) {
+    for (uint64_t i = 0; i < other.slots.size(); i++) {
+      const Entry &entry = other.slots[i];
+      if (entry.executions) {
+        add(entry.pc, entry.executions, entry.mispredictions, entry.taken);
+      }
+    }
+    untrackedExecutions += other.untrackedExecutions;
+  }
+
+  void clear() {
+    Entry empty = {0, 0, 0, 0};
+    std::fill(slots.begin(), slots.end(), empty);
+    used = 0;
+    untrackedExecutions = 0;
+  }
+
+  // Executions of branches that did not fit into the table
+  uint64_t untracked() const {
+    return untrackedExecutions;
+  }
+
+  // The count branches with the most mispredictions, the most first
+  std::vector<Entry> top(uint64_t count) const {
+    std::vector<Entry> entries;
+    entries.reserve(used);
+    for (uint64_t i = 0; i < slots.size(); i++) {
+      if (slots[i].executions) {
+        entries.push_back(slots[i]);
+      }
+    }
+    count = std::min<uint64_t>(count, entries.size());
+    std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), [](const Entry &a, const Entry &b) {
+      return a.mispredictions != b.mispredictions ? a.mispredictions > b.mispredictions : a.pc < b.pc;
+    });
+    entries.resize(count);
+    return entries;
+  }
+};
+
+// Runs predictor over a batch of branches. The calls are qualified with the
+// predictor class, so there is no virtual dispatch inside the loop, and the
+// counters stay in locals for the whole batch
+//
+template <class Predictor>
+inline void SimulateBranches(Predictor &predictor, const BranchEvent *events, uint32_t numEvents, BranchPredictorStats &stats) {
+  BranchPredictorStats batchStats = stats;
+
+  for (uint32_t i = 0; i < numEvents; i++) {
+    batchStats.record(predictor.Predictor::predictAndTrain(events[i].pc, events[i].taken), events[i].taken);
+  }
+
+  stats = batchStats;
+}
+
+// The same, also counting every branch in profile
+//
+template <class Predictor>
+inline void SimulateBranches(Predictor &predictor, const BranchEvent *events, uint32_t numEvents, BranchPredictorStats &stats, BranchProfile &profile) {
+  BranchPredictorStats batchStats = stats;
+
+  for (uint32_t i = 0; i < numEvents; i++) {
+    bool wasPredictedTaken = predictor.Predictor::predictAndTrain(events[i].pc, events[i].taken);
+    batchStats.record(wasPredictedTaken, events[i].taken);
+    profile.record(events[i].pc, wasPredictedTaken, events[i].taken);
+  }
+
+  stats = batchStats;
+}
+
+/* Several gshare predictors with the same table size, simulated side by side */
+// Lane k behaves exactly like a GshareBranchPredictor with historyBits[k] bits of
+// global history; only the histories differ between lanes, so every lane needs the
+// same index function. The state is kept as structure of arrays: the history
+// registers of all lanes next to each other, and one byte per counter with the
+// table of each lane after the previous one. For every branch the lanes are then
+// a short loop over plain arrays. With AVX2 and a power-of-two table, eight lanes
+// are indexed, read with one gather and updated at once; the updated counters
+// are written back lane by lane, as AVX2 has no scatter.
+//
+class GshareSweepKernel {
+
+private:
+
+  static const uint32_t SIMD_LANES = 8;
+
+  TableIndexer PHTindex;
+  uint32_t numLanes;
+  uint32_t numPaddedLanes;
+  CacheAlignedVector<uint64_t> GHR;
+  CacheAlignedVector<uint64_t> historyMask;
+  // numPaddedLanes tables of PHTindex.size() counters, plus slack for 32-bit gathers
+  CacheAlignedVector<uint8_t> counters;
+  bool vectorized;
+
+  void simulateScalar(const BranchEvent *events, uint32_t numEvents, BranchPredictorStats *stats) {
+    uint64_t numEntries = PHTindex.size();
+    for (uint32_t k = 0; k < numLanes; k++) {
+      uint8_t *PHT = &counters[k * numEntries];
+      uint64_t history = GHR[k];
+      uint64_t mask = historyMask[k];
+      BranchPredictorStats laneStats = stats[k];
+
+      for (uint32_t i = 0; i < numEvents; i++) {
+        uint64_t index = PHTindex(events[i].pc ^ history);
+        uint8_t counter = PHT[index];
+        bool taken = events[i].taken;
+        PHT[index] = taken ? counter + (counter < 3) : counter - (counter > 0);
+        history = ((history<<1) + taken) & mask;
+        laneStats.record(counter >= 2, taken);
+      }
+
+      GHR[k] = history;
+      stats[k] = laneStats;
+    }
+  }
+
+#ifdef __AVX2__
+  // Only used for tables of at most 2^28 entries, so that every byte offset fits in a
+  // gather index. The lanes keep the low 32 bits of each history, which are all
+  // that such an index depends on
+  void simulateAVX2(const BranchEvent *events, uint32_t numEvents, BranchPredictorStats *stats) {
+    uint32_t numEntries = PHTindex.size();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i indexMask = _mm256_set1_epi32(numEntries - 1);
+
+    for (uint32_t first = 0; first < numPaddedLanes; first += SIMD_LANES) {
+      alignas(32) uint32_t lanes[SIMD_LANES];
+      for (uint32_t k = 0; k < SIMD_LANES; k++) {
+        lanes[k] = GHR[first + k];
+      }
+      __m256i history = _mm256_load_si256((const __m256i *)lanes);
+      for (uint32_t k = 0; k < SIMD_LANES; k++) {
+        lanes[k] = historyMask[first + k];
+      }
+      __m256i mask = _mm256_load_si256((const __m256i *)lanes);
+      for (uint32_t k = 0; k < SIMD_LANES; k++) {
+        lanes[k] = (first + k) * numEntries;
+      }
+      __m256i tableOffset = _mm256_load_si256((const __m256i *)lanes);
+
+      // counts of the batch, subtracting the all-ones compare results
+      __m256i correct = zero;
+      __m256i predictedTaken = zero;
+
+      for (uint32_t i = 0; i < numEvents; i++) {
+        __m256i taken = _mm256_set1_epi32(events[i].taken);
+        __m256i index = _mm256_and_si256(_mm256_xor_si256(_mm256_set1_epi32((uint32_t)events[i].pc), history), indexMask);
+        __m256i offset = _mm256_add_epi32(tableOffset, index);
+        __m256i counter = _mm256_and_si256(_mm256_i32gather_epi32((const int *)counters.data(), offset, 1), byteMask);
+
+        __m256i prediction = _mm256_cmpgt_epi32(counter, one);
+        correct = _mm256_sub_epi32(correct, _mm256_cmpeq_epi32(_mm256_and_si256(prediction, one), taken));
+        predictedTaken = _mm256_sub_epi32(predictedTaken, prediction);
+
+        __m256i updated = events[i].taken ? _mm256_min_epi32(_mm256_add_epi32(counter, one), three)
+                                          : _mm256_max_epi32(_mm256_sub_epi32(counter, one), zero);
+        _mm256_store_si256((__m256i *)lanes, updated);
+        alignas(32) uint32_t offsets[SIMD_LANES];
+        _mm256_store_si256((__m256i *)offsets, offset);
+        for (uint32_t k = 0; k < SIMD_LANES; k++) {
+          counters[offsets[k]] = lanes[k];
+        }
+
+        history = _mm256_and_si256(_mm256_add_epi32(_mm256_slli_epi32(history, 1), taken), mask);
+      }
+
+      _mm256_store_si256((__m256i *)lanes, history);
+      for (uint32_t k = 0; k < SIMD_LANES; k++) {
+        GHR[first + k] = lanes[k];
+      }
+      alignas(32) uint32_t correctCounts[SIMD_LANES];
+      alignas(32) uint32_t predictedTakenCounts[SIMD_LANES];
+      _mm256_store_si256((__m256i *)correctCounts, correct);
+      _mm256_store_si256((__m256i *)predictedTakenCounts, predictedTaken);
+      for (uint32_t k = 0; k < SIMD_LANES && first + k < numLanes; k++) {
+        stats[first + k].correctPredictionCount         += correctCounts[k];
+        stats[first + k].predictedTakenBranchesCount    += predictedTakenCounts[k];
+        stats[first + k].predictedNotTakenBranchesCount += numEvents - predictedTakenCounts[k];
+      }
+    }
+  }
+#endif
+
+public:
+
+  GshareSweepKernel(uint64_t numEntries, const std::vector<uint32_t> &historyBits)
+    : PHTindex(numEntries),
+      numLanes(historyBits.size()),
+      numPaddedLanes(historyBits.size()),
+      vectorized(false) {
+#ifdef __AVX2__
+    // unused lanes fill up the last group of eight and are never reported
+    uint32_t paddedLanes = (numLanes + SIMD_LANES - 1) / SIMD_LANES * SIMD_LANES;
+    if ((numEntries & (numEntries - 1)) == 0 && numEntries * paddedLanes <= (1ULL << 28)) {
+      numPaddedLanes = paddedLanes;
+      vectorized = true;
+    }
+#endif
+    GHR.assign(numPaddedLanes, 0);
+    historyMask.assign(numPaddedLanes, 0);
+    for (uint32_t k = 0; k < numLanes; k++) {
+      historyMask[k] = historyMaskOf(historyBits[k]);
+    }
+    counters.assign(numPaddedLanes * numEntries + 3, 0b11);
+  }
+
+  uint32_t lanes() const {
+    return numLanes;
+  }
+
+  // Saves or loads lane k in the layout of GshareBranchPredictor::serialize(), so
+  // that a snapshot does not depend on whether the kernel was used
+  void serializeLane(PredictorStateArchive &archive, uint32_t k) {
+    uint64_t numEntries = PHTindex.size();
+    uint8_t *lane = &counters[k * numEntries];
+    std::array<uint64_t, 0> olderHistory;
+    archive.value(GHR[k]);
+    archive.array(olderHistory);
+    GHR[k] &= historyMask[k];
+
+    TwoBitCounterTable PHT(numEntries, 0);
+    for (uint64_t i = 0; i < numEntries; i++) {
+      PHT.set(i, lane[i]);
+    }
+    PHT.serialize(archive);
+    for (uint64_t i = 0; i < numEntries; i++) {
+      lane[i] = PHT.get(i);
+    }
+  }
+
+  // Predicts and trains every lane on a batch of branches, adding the counters of lane k to stats[k]
+  void simulate(const BranchEvent *events, uint32_t numEvents, BranchPredictorStats *stats) {
+#ifdef __AVX2__
+    if (vectorized) {
+      simulateAVX2(events, numEvents, stats);
+      return;
+    }
+#endif
+    simulateScalar(events, numEvents, stats);
+  }
+};
+
+// Calls factory.create<Predictor>() with the predictor class named by config.type,
+// so that each driver can instantiate its routines for the concrete class. Unless
+// specialized is false, the sizes in CommonStaticPredictorSizes get the classes
+// compiled for them. Returns false for an unknown type
+//
+template <class Factory>
+bool CreateUndelayedBranchPredictorOfType(const BranchPredictorConfig &config, Factory &factory, bool specialized) {
+  const std::string &type = config.type;
+  if (type == "always_taken") {
+    factory.template create<AlwaysTakenBranchPredictor>();
+  }
+//------------------------------------------------------------------------------
+//##############################################################################
+/*
+ * Insert your changes below here...
+ *
+ * In the following cascading if-statements instantiate branch predictor objects
+ * using the classes that you have implemented for each of the three types of
+ * predictor.
+ *
+ * The choice of predictor is given by type, which the Pin tool takes from
+ * tool option "-BP_type" (and "-sweep"), and the sizes of its tables are in the
+ * config that the factory passes to the constructor.
+ *
+ *  The argument of tool option "-BP_type" must be one of the strings: 
+ *      "always_taken",  "local",  "gshare",  "tournament",  "tage",  "perceptron",
+ *      "hybrid"
+ *
+ *  Please DO NOT CHANGE these strings - they will be used for testing your code
+ */
+//##############################################################################
+//------------------------------------------------------------------------------
+  else if (type == "local") {
+    if (!specialized || !CommonStaticPredictorSizes::createLocal(config, factory)) {
+      factory.template create<LocalBranchPredictor>();
+    }
+  }
+  else if (type == "gshare") {
+    if (!specialized || !CommonStaticPredictorSizes::createGshare(config, factory)) {
+      factory.template create<GshareBranchPredictor>();
+    }
+  }
+  else if (type == "tournament") {
+    factory.template create<TournamentBranchPredictor>();
+  }
+  else if (type == "tage") {
+    factory.template create<TageBranchPredictor>();
+  }
+  else if (type == "perceptron") {
+    factory.template create<PerceptronBranchPredictor>();
+  }
+  else if (type == "hybrid") {
+    factory.template create<HybridBranchPredictor>();
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+/* Passes DelayedUpdateBranchPredictor<Predictor> on to factory instead of Predictor */
+// hybrid cannot be delayed, CheckBranchPredictorConfig() refuses it, but it needs a
+// class to compile against
+//
+template <class Factory>
+struct DelayedUpdateFactory {
+  Factory &factory;
+
+  template <class Predictor>
+  void create() {
+    createDelayed((Predictor *)NULL);
+  }
+
+  template <class Predictor>
+  void createDelayed(Predictor *) {
+    factory.template create<DelayedUpdateBranchPredictor<Predictor> >();
+  }
+
+  void createDelayed(HybridBranchPredictor *) {
+    factory.template create<HybridBranchPredictor>();
+  }
+};
+
+// The same, wrapping the predictor in a DelayedUpdateBranchPredictor when
+// config.updateDelay is set
+//
+template <class Factory>
+bool CreateBranchPredictorOfType(const BranchPredictorConfig &config, Factory &factory, bool specialized = true) {
+  if (config.updateDelay == 0) {
+    return CreateUndelayedBranchPredictorOfType(config, factory, specialized);
+  }
+  DelayedUpdateFactory<Factory> delayed = {factory};
+  return CreateUndelayedBranchPredictorOfType(config, delayed, specialized);
+}
+
+/* Builds one component of a HybridBranchPredictor for CreateBranchPredictorOfType() */
+//
+// Called once with a NULL arena to add up the bytes of the components, then
+// again to build each of them at its offset in the arena
+//
+struct HybridComponentFactory {
+  const BranchPredictorConfig &config;
+  char *arena;
+  size_t bytes;                          // offset of the next component
+  BranchPredictorInterface *component;
+
+  template <class Predictor>
+  void create() {
+    if (arena) {
+      component = ::new (arena + bytes) Predictor(config);
+    }
+    bytes += (sizeof(Predictor) + CACHE_LINE_BYTES - 1) & ~(CACHE_LINE_BYTES - 1);
+  }
+};
+
+inline HybridBranchPredictor::HybridBranchPredictor(const BranchPredictorConfig &config)
+  : arena(NULL),
+    chooserIndex(config.numEntries),
+    chooserHistory(config.chooserHistoryBits) {
+  std::vector<BranchPredictorConfig> componentConfigs;
+  std::istringstream names(config.hybridComponents);
+  std::string name;
+  size_t bytes = 0;
+  while (std::getline(names, name, '+')) {
+    // CheckBranchPredictorConfig() has made sure that these are known and not hybrid
+    BranchPredictorConfig componentConfig = config;
+    componentConfig.type = name;
+    HybridComponentFactory factory = {componentConfig, NULL, bytes, NULL};
+    if (name != "hybrid" && CreateBranchPredictorOfType(componentConfig, factory)) {
+      componentConfigs.push_back(componentConfig);
+      bytes = factory.bytes;
+    }
+  }
+
+  arena = static_cast<char *>(AllocateCacheAligned(bytes));
+  bytes = 0;
+  for (uint32_t i = 0; i < componentConfigs.size(); i++) {
+    HybridComponentFactory factory = {componentConfigs[i], arena, bytes, NULL};
+    CreateBranchPredictorOfType(componentConfigs[i], factory);
+    components.push_back(factory.component);
+    bytes = factory.bytes;
+  }
+  confidence.assign(config.numEntries * components.size(), 3);
+  predictions.assign(components.size(), 0);
+}
+
+/* Only checks that a type exists, for CreateBranchPredictorOfType() */
+//
+struct BranchPredictorTypeCheck {
+  template <class Predictor>
+  void create() {}
+};
+
+// Returns why the sizes or history lengths of config are not supported, or NULL if they are
+//
+inline const char *CheckBranchPredictorConfig(const BranchPredictorConfig &config) {
+  // Table sizes need not be powers of two, but must fit the 32-bit fast remainder
+  if (config.numEntries == 0 || config.numEntries > (1ULL << 32) ||
+      config.numLHTEntries == 0 || config.numLHTEntries > (1ULL << 32)) {
+    return "Table sizes must be between 1 and 2^32 entries.";
+  }
+  // tage and perceptron do not keep their history in a single word, the
+  // history lengths of a hybrid are checked for each of its components
+  uint32_t maxGlobalHistoryBits = config.type == "tage" || config.type == "perceptron" ? 1024 : 63;
+  if (config.type != "hybrid" &&
+      (config.localHistoryBitsOrDefault() > 32 || config.globalHistoryBitsOrDefault() > maxGlobalHistoryBits)) {
+    return "Local history is limited to 32 bits and global history to 63 bits (1024 bits for tage and perceptron).";
+  }
+  if (config.updateDelay > BranchPredictorConfig::MAX_UPDATE_DELAY) {
+    return "The update delay is limited to 4096 branches.";
+  }
+  if (config.updateDelay && config.type == "hybrid") {
+    return "A hybrid predictor cannot be simulated with an update delay.";
+  }
+  if (config.type == "hybrid") {
+    if (config.chooserHistoryBits > 63) {
+      return "The hybrid chooser history is limited to 63 bits.";
+    }
+    std::istringstream names(config.hybridComponents);
+    std::string name;
+    uint32_t numComponents = 0;
+    while (std::getline(names, name, '+')) {
+      BranchPredictorConfig componentConfig = config;
+      componentConfig.type = name;
+      BranchPredictorTypeCheck check;
+      if (name == "hybrid" || !CreateBranchPredictorOfType(componentConfig, check)) {
+        return "Hybrid components must be known predictor types other than hybrid.";
+      }
+      const char *error = CheckBranchPredictorConfig(componentConfig);
+      if (error) {
+        return error;
+      }
+      numComponents++;
+    }
+    if (numComponents < 2) {
+      return "A hybrid predictor needs at least two components.";
+    }
+  }
+  return NULL;
+}
+
+// Start of a predictor state snapshot, written before the predictors it holds
+//
+static const std::string PREDICTOR_STATE_MAGIC = "BPSTATE";
+static const uint32_t PREDICTOR_STATE_VERSION = 1;
+
+// Writes config to a snapshot, or checks that the snapshot being loaded was taken
+// from a predictor of the same type and sizes
+//
+inline void SerializeBranchPredictorConfig(PredictorStateArchive &archive, const BranchPredictorConfig &config) {
+  archive.expect(config.type);
+  archive.expect(config.numEntries);
+  archive.expect(config.numLHTEntries);
+  archive.expect(config.localHistoryBitsOrDefault());
+  archive.expect(config.globalHistoryBitsOrDefault());
+  if (config.type == "hybrid") {
+    archive.expect(config.hybridComponents);
+    archive.expect(config.chooserHistoryBits);
+  }
+}
+
+// Parses a -sweep list into configs. Fields left out of an entry (or left empty)
+// are taken from defaults. Returns false if the list is malformed
+//
+inline bool ParseSweepConfigs(const std::string &list, const BranchPredictorConfig &defaults, std::vector<BranchPredictorConfig> &configs) {
+  std::istringstream entries(list);
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    std::istringstream fields(entry);
+    std::string field;
+    BranchPredictorConfig config = defaults;
+    for (uint32_t i = 0; std::getline(fields, field, ':'); i++) {
+      if (i == 0) {
+        config.type = field;
+        continue;
+      }
+      if (field.empty()) {
+        continue;
+      }
+      char *end;
+      uint64_t value = std::strtoull(field.c_str(), &end, 0);
+      if (*end != '\0') {
+        return false;
+      }
+      switch (i) {
+        case 1: config.numEntries        = value; break;
+        case 2: config.numLHTEntries     = value; break;
+        case 3: config.localHistoryBits  = value; break;
+        case 4: config.globalHistoryBits = value; break;
+        case 5: config.updateDelay       = value; break;
+        default: return false;
+      }
+    }
+    if (config.type.empty()) {
+      return false;
+    }
+    configs.push_back(config);
+  }
+  return !configs.empty();
+}
+
+// Prints the counters of a simulation. Each element of results has a config and
+// stats member. A single predictor is printed in the original BP_stats.out layout,
+// several get one row per configuration. If the number of instructions the
+// branches came from is known, the branch density and MPKI are printed as well
+//
+template <class Result>
+void WriteBranchPredictorReport(std::ostream &out, const BranchStreamStats &stream, const std::vector<Result> &results, uint64_t instructions = 0) {
+  out.setf(std::ios::showbase);
+  double kiloInstructions = instructions / 1000.0;
+  if (results.size() == 1) {
+    const BranchPredictorStats &stats = results[0].stats;
+    out << "Prediction accuracy:\t"                    << (double)stats.correctPredictionCount / (double)stream.conditionalBranchesCount << std::endl
+        << "Number of conditional branches:\t"         << stream.conditionalBranchesCount                                            << std::endl
+        << "Number of correct predictions:\t"          << stats.correctPredictionCount                                               << std::endl
+        << "Number of taken branches:\t"               << stream.takenBranchesCount                                                  << std::endl
+        << "Number of non-taken branches:\t"           << stream.notTakenBranchesCount                                               << std::endl
+        << "Number of predicted taken branches:\t"     << stats.predictedTakenBranchesCount                                          << std::endl
+        << "Number of predicted non-taken branches:\t" << stats.predictedNotTakenBranchesCount                                       << std::endl
+        ;
+    if (results[0].config.updateDelay) {
+      out << "Update delay (branches):\t"                << results[0].config.updateDelay                                              << std::endl;
+    }
+    if (instructions) {
+      out << "Number of instructions:\t"                      << instructions                                                                     << std::endl
+          << "Conditional branches per 1000 instructions:\t"  << stream.conditionalBranchesCount / kiloInstructions                               << std::endl
+          << "Mispredictions per 1000 instructions (MPKI):\t" << (stream.conditionalBranchesCount - stats.correctPredictionCount) / kiloInstructions << std::endl
+          ;
+    }
+    return;
+  }
+
+  // One row per swept configuration, all of them simulated on the same branches
+  out << "Number of conditional branches:\t" << stream.conditionalBranchesCount << std::endl
+      << "Number of taken branches:\t"       << stream.takenBranchesCount       << std::endl
+      << "Number of non-taken branches:\t"   << stream.notTakenBranchesCount    << std::endl;
+  if (instructions) {
+    out << "Number of instructions:\t"                     << instructions                                         << std::endl
+        << "Conditional branches per 1000 instructions:\t" << stream.conditionalBranchesCount / kiloInstructions << std::endl;
+  }
+  // the update_delay column only if some configuration has a delay
+  bool delayed = false;
+  for (uint32_t i = 0; i < results.size(); i++) {
+    delayed = delayed || results[i].config.updateDelay != 0;
+  }
+  out << std::endl
+      << "BP_type\tnum_BP_entries\tnum_LHT_entries\tlocal_history_bits\tglobal_history_bits\t"
+      << (delayed ? "update_delay\t" : "")
+      << "Prediction accuracy\tNumber of correct predictions\tNumber of predicted taken branches"
+      << (instructions ? "\tMPKI" : "") << std::endl;
+  for (uint32_t i = 0; i < results.size(); i++) {
+    const BranchPredictorConfig &config = results[i].config;
+    const BranchPredictorStats &stats = results[i].stats;
+    out << config.type                                                                 << "\t"
+        << config.numEntries                                                           << "\t"
+        << config.numLHTEntries                                                        << "\t"
+        << config.localHistoryBitsOrDefault()                                          << "\t"
+        << config.globalHistoryBitsOrDefault()                                         << "\t";
+    if (delayed) {
+      out << config.updateDelay                                                        << "\t";
+    }
+    out << (double)stats.correctPredictionCount / (double)stream.conditionalBranchesCount << "\t"
+        << stats.correctPredictionCount                                                << "\t"
+        << stats.predictedTakenBranchesCount;
+    if (instructions) {
+      out << "\t" << (stream.conditionalBranchesCount - stats.correctPredictionCount) / kiloInstructions;
+    }
+    out << std::endl;
+  }
+}
+
+/* Options of a run, as name and value, written with the machine-readable results */
+//
+typedef std::vector<std::pair<std::string, std::string> > BranchResultOptions;
+
+// Writes text as a JSON string, with quotes, backslashes and control characters escaped
+//
+inline void WriteJSONString(std::ostream &out, const std::string &text) {
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  out << '"';
+  for (size_t i = 0; i < text.size(); i++) {
+    unsigned char c = text[i];
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    }
+    else if (c < 0x20) {
+      out << "\\u00" << HEX_DIGITS[c >> 4] << HEX_DIGITS[c & 0xf];
+    }
+    else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// Writes text as a CSV field, quoted if it holds a comma, a quote or a line break
+//
+inline void WriteCSVField(std::ostream &out, const std::string &text) {
+  if (text.find_first_of(",\"\r\n") == std::string::npos) {
+    out << text;
+    return;
+  }
+  out << '"';
+  for (size_t i = 0; i < text.size(); i++) {
+    out << (text[i] == '"' ? "\"\"" : std::string(1, text[i]));
+  }
+  out << '"';
+}
+
+// Writes the same counters as WriteBranchPredictorReport() as one JSON object: the
+// options of the run, its wall time, the counts of the branch stream and, for every
+// element of results, its whole configuration, its counters and the metrics derived
+// from them. The metrics per instruction are null if instructions is 0
+//
+template <class Result>
+void WriteBranchPredictorResultsJSON(std::ostream &out, const BranchStreamStats &stream, const std::vector<Result> &results,
+                                     uint64_t instructions, double seconds, const BranchResultOptions &options) {
+  double branches = (double)stream.conditionalBranchesCount;
+  double kiloInstructions = instructions / 1000.0;
+
+  out << "{" << std::endl << "  \"options\": {";
+  for (uint32_t i = 0; i < options.size(); i++) {
+    out << (i ? ", " : "");
+    WriteJSONString(out, options[i].first);
+    out << ": ";
+    WriteJSONString(out, options[i].second);
+  }
+  out << "}," << std::endl
+      << "  \"wall_seconds\": "         << seconds                         << "," << std::endl
+      << "  \"instructions\": "         << instructions                    << "," << std::endl
+      << "  \"conditional_branches\": " << stream.conditionalBranchesCount << "," << std::endl
+      << "  \"taken_branches\": "       << stream.takenBranchesCount       << "," << std::endl
+      << "  \"not_taken_branches\": "   << stream.notTakenBranchesCount    << "," << std::endl
+      << "  \"branches_per_kilo_instruction\": ";
+  if (instructions) {
+    out << branches / kiloInstructions;
+  } else {
+    out << "null";
+  }
+  out << "," << std::endl << "  \"predictors\": [";
+
+  for (uint32_t i = 0; i < results.size(); i++) {
+    const BranchPredictorConfig &config = results[i].config;
+    const BranchPredictorStats &stats = results[i].stats;
+    uint64_t mispredictions = stream.conditionalBranchesCount - stats.correctPredictionCount;
+
+    out << (i ? "," : "") << std::endl << "    {\"type\": ";
+    WriteJSONString(out, config.type);
+    out << ", \"num_BP_entries\": "       << config.numEntries
+        << ", \"num_LHT_entries\": "      << config.numLHTEntries
+        << ", \"local_history_bits\": "   << config.localHistoryBitsOrDefault()
+        << ", \"global_history_bits\": "  << config.globalHistoryBitsOrDefault()
+        << ", \"hybrid_components\": ";
+    WriteJSONString(out, config.hybridComponents);
+    out << ", \"chooser_history_bits\": " << config.chooserHistoryBits
+        << ", \"update_delay\": "         << config.updateDelay        << "," << std::endl
+        << "     \"correct_predictions\": "         << stats.correctPredictionCount
+        << ", \"mispredictions\": "                << mispredictions
+        << ", \"predicted_taken_branches\": "      << stats.predictedTakenBranchesCount
+        << ", \"predicted_not_taken_branches\": "  << stats.predictedNotTakenBranchesCount
+        << ", \"accuracy\": "                      << (branches ? stats.correctPredictionCount / branches : 0.0)
+        << ", \"mpki\": ";
+    if (instructions) {
+      out << mispredictions / kiloInstructions;
+    } else {
+      out << "null";
+    }
+    out << "}";
+  }
+  out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+// The same as CSV with a header line and one line per element of results, each
+// repeating the counts of the stream and the options so that the files of many runs
+// can be concatenated (without their header lines) into one table. The metrics per
+// instruction are empty if instructions is 0
+//
+template <class Result>
+void WriteBranchPredictorResultsCSV(std::ostream &out, const BranchStreamStats &stream, const std::vector<Result> &results,
+                                    uint64_t instructions, double seconds, const BranchResultOptions &options) {
+  double branches = (double)stream.conditionalBranchesCount;
+  double kiloInstructions = instructions / 1000.0;
+
+  out << "type,num_BP_entries,num_LHT_entries,local_history_bits,global_history_bits,hybrid_components,chooser_history_bits,update_delay,"
+      << "instructions,conditional_branches,taken_branches,not_taken_branches,"
+      << "correct_predictions,mispredictions,predicted_taken_branches,predicted_not_taken_branches,"
+      << "accuracy,mpki,branches_per_kilo_instruction,wall_seconds";
+  for (uint32_t i = 0; i < options.size(); i++) {
+    out << "," << options[i].first;
+  }
+  out << std::endl;
+
+  for (uint32_t i = 0; i < results.size(); i++) {
+    const BranchPredictorConfig &config = results[i].config;
+    const BranchPredictorStats &stats = results[i].stats;
+    uint64_t mispredictions = stream.conditionalBranchesCount - stats.correctPredictionCount;
+
+    WriteCSVField(out, config.type);
+    out << "," << config.numEntries
+        << "," << config.numLHTEntries
+        << "," << config.localHistoryBitsOrDefault()
+        << "," << config.globalHistoryBitsOrDefault()
+        << ",";
+    WriteCSVField(out, config.hybridComponents);
+    out << "," << config.chooserHistoryBits
+        << "," << config.updateDelay
+        << "," << instructions
+        << "," << stream.conditionalBranchesCount
+        << "," << stream.takenBranchesCount
+        << "," << stream.notTakenBranchesCount
+        << "," << stats.correctPredictionCount
+        << "," << mispredictions
+        << "," << stats.predictedTakenBranchesCount
+        << "," << stats.predictedNotTakenBranchesCount
+        << "," << (branches ? stats.correctPredictionCount / branches : 0.0)
+        << ",";
+    if (instructions) {
+      out << mispredictions / kiloInstructions << "," << branches / kiloInstructions;
+    } else {
+      out << ",";
+    }
+    out << "," << seconds;
+    for (uint32_t j = 0; j < options.size(); j++) {
+      out << ",";
+      WriteCSVField(out, options[j].second);
+    }
+    out << std::endl;
+  }
+}
+
+/* Counters of a simulation split into consecutive intervals of instructions */
+// record() is called with the running totals at the end of every interval and
+// keeps what happened since the previous call as one row, in arrays reserved up
+// front; nothing is formatted until the series is written at the end. Series of
+// streams simulated separately (one per thread) are merged row by row. A sampled
+// simulation keeps one row per detailed window, skipping what lies in between.
+//
+class BranchIntervalSeries {
+
+private:
+
+  uint32_t numPredictors;
+  std::vector<uint64_t> instructions;
+  std::vector<uint64_t> branches;
+  std::vector<uint64_t> taken;
+  std::vector<uint64_t> correct;   // numPredictors per row
+
+  // running totals at the end of the last row
+  uint64_t lastInstructions;
+  BranchStreamStats lastStream;
+  std::vector<uint64_t> lastCorrect;
+
+  static double rate(uint64_t count, uint64_t total) {
+    return total ? (double)count / (double)total : 0.0;
+  }
+
+  double mpki(uint64_t row, uint32_t predictor) const {
+    uint64_t mispredictions = branches[row] - correct[row * numPredictors + predictor];
+    return instructions[row] ? 1000.0 * mispredictions / instructions[row] : 0.0;
+  }
+
+  // A predictor in the -sweep syntax, followed for a hybrid by its components
+  // and chooser history bits, which the syntax does not hold
+  static std::string configLabel(const BranchPredictorConfig &config) {
+    std::ostringstream label;
+    label << config.type << ":" << config.numEntries << ":" << config.numLHTEntries << ":"
+          << config.localHistoryBitsOrDefault() << ":" << config.globalHistoryBitsOrDefault() << ":"
+          << config.updateDelay;
+    if (config.type == "hybrid") {
+      label << ":" << config.hybridComponents << ":" << config.chooserHistoryBits;
+    }
+    return label.str();
+  }
+
+public:
+
+  BranchIntervalSeries() : numPredictors(0), lastInstructions(0) {}
+
+  void init(uint32_t predictors, uint64_t expectedRows) {
+    numPredictors = predictors;
+    instructions.reserve(expectedRows);
+    branches.reserve(expectedRows);
+    taken.reserve(expectedRows);
+    correct.reserve(expectedRows * predictors);
+    lastCorrect.assign(predictors, 0);
+  }
+
+  uint64_t rows() const {
+    return instructions.size();
+  }
+
+  // Ends the current row at totalInstructions executed. Each element of results
+  // has a stats member, like for WriteBranchPredictorReport()
+  template <class Result>
+  void record(uint64_t totalInstructions, const BranchStreamStats &stream, const std::vector<Result> &results) {
+    if (totalInstructions == lastInstructions && stream.conditionalBranchesCount == lastStream.conditionalBranchesCount) {
+      return;
+    }
+    instructions.push_back(totalInstructions - lastInstructions);
+    branches.push_back(stream.conditionalBranchesCount - lastStream.conditionalBranchesCount);
+    taken.push_back(stream.takenBranchesCount - lastStream.takenBranchesCount);
+    for (uint32_t i = 0; i < numPredictors; i++) {
+      correct.push_back(results[i].stats.correctPredictionCount - lastCorrect[i]);
+      lastCorrect[i] = results[i].stats.correctPredictionCount;
+    }
+    lastInstructions = totalInstructions;
+    lastStream = stream;
+  }
+
+  // Starts the next row at totalInstructions without recording what happened
+  // since the last one
+  template <class Result>
+  void skipTo(uint64_t totalInstructions, const BranchStreamStats &stream, const std::vector<Result> &results) {
+    for (uint32_t i = 0; i < numPredictors; i++) {
+      lastCorrect[i] = results[i].stats.correctPredictionCount;
+    }
+    lastInstructions = totalInstructions;
+    lastStream = stream;
+  }
+
+  // Continues with counters that have been reset to zero, after the last row
+  // was recorded with their old values
+  void rebase() {
+    lastStream = BranchStreamStats();
+    std::fill(lastCorrect.begin(), lastCorrect.end(), 0);
+  }
+
+  void merge(const BranchIntervalSeries &other) {
+    if (other.rows() > rows()) {
+      instructions.resize(other.rows(), 0);
+      branches.resize(other.rows(), 0);
+      taken.resize(other.rows(), 0);
+      correct.resize(other.rows() * numPredictors, 0);
+    }
+    for (uint64_t row = 0; row < other.rows(); row++) {
+      instructions[row] += other.instructions[row];
+      branches[row]     += other.branches[row];
+      taken[row]        += other.taken[row];
+      for (uint32_t i = 0; i < numPredictors; i++) {
+        correct[row * numPredictors + i] += other.correct[row * numPredictors + i];
+      }
+    }
+  }
+
+  // Writes one line per interval with its instructions, conditional branches and
+  // taken rate, and the accuracy and mispredictions per 1000 instructions of every
+  // predictor. Each element of results has a config member
+  template <class Result>
+  void writeCSV(std::ostream &out, const std::vector<Result> &results) const {
+    out << "interval,instructions,conditional_branches,taken_rate";
+    for (uint32_t i = 0; i < numPredictors; i++) {
+      std::string label = configLabel(results[i].config);
+      out << "," << label << "_accuracy," << label << "_mpki";
+    }
+    out << std::endl;
+    for (uint64_t row = 0; row < rows(); row++) {
+      out << row << "," << instructions[row] << "," << branches[row] << "," << rate(taken[row], branches[row]);
+      for (uint32_t i = 0; i < numPredictors; i++) {
+        out << "," << rate(correct[row * numPredictors + i], branches[row]) << "," << mpki(row, i);
+      }
+      out << std::endl;
+    }
+  }
+
+  // The same as one JSON object, with an array per predictor
+  template <class Result>
+  void writeJSON(std::ostream &out, const std::vector<Result> &results) const {
+    out << "{" << std::endl << "  \"predictors\": [";
+    for (uint32_t i = 0; i < numPredictors; i++) {
+      out << (i ? ", " : "") << "\"" << configLabel(results[i].config) << "\"";
+    }
+    out << "]," << std::endl << "  \"intervals\": [";
+    for (uint64_t row = 0; row < rows(); row++) {
+      out << (row ? "," : "") << std::endl
+          << "    {\"instructions\": " << instructions[row]
+          << ", \"conditional_branches\": " << branches[row]
+          << ", \"taken_rate\": " << rate(taken[row], branches[row])
+          << ", \"accuracy\": [";
+      for (uint32_t i = 0; i < numPredictors; i++) {
+        out << (i ? ", " : "") << rate(correct[row * numPredictors + i], branches[row]);
+      }
+      out << "], \"mpki\": [";
+      for (uint32_t i = 0; i < numPredictors; i++) {
+        out << (i ? ", " : "") << mpki(row, i);
+      }
+      out << "]}";
+    }
+    out << std::endl << "  ]" << std::endl << "}" << std::endl;
+  }
+
+  // Treats the rows as samples of a longer run of totalInstructions and prints the
+  // accuracy and MPKI of every predictor estimated from them, with the half width of
+  // their 95% confidence intervals. Both are ratio estimates (the sum over the rows
+  // divided by the sum of branches or instructions), and their variance comes from
+  // how much the rows differ from that ratio. The normal approximation needs a few
+  // dozen rows to be trusted; with fewer than two there is no interval at all
+  template <class Result>
+  void writeEstimate(std::ostream &out, const std::vector<Result> &results, uint64_t totalInstructions) const {
+    const double z95 = 1.96;
+    uint64_t k = rows();
+    uint64_t sumInstructions = 0, sumBranches = 0;
+    for (uint64_t row = 0; row < k; row++) {
+      sumInstructions += instructions[row];
+      sumBranches     += branches[row];
+    }
+
+    out << std::endl
+        << "Sampled windows:\t"              << k               << std::endl
+        << "Instructions in the windows:\t"  << sumInstructions << std::endl
+        << "Branches in the windows:\t"      << sumBranches     << std::endl;
+    if (sumBranches == 0 || sumInstructions == 0) {
+      return;
+    }
+    out << "Predictor\tEstimated accuracy\t+/-\tEstimated MPKI\t+/-\tEstimated mispredictions" << std::endl;
+    for (uint32_t i = 0; i < numPredictors; i++) {
+      uint64_t sumCorrect = 0;
+      for (uint64_t row = 0; row < k; row++) {
+        sumCorrect += correct[row * numPredictors + i];
+      }
+      double accuracy = (double)sumCorrect / (double)sumBranches;
+      double mispredictionsPerInstruction = (double)(sumBranches - sumCorrect) / (double)sumInstructions;
+
+      double accuracyResiduals = 0.0, mpkiResiduals = 0.0;
+      for (uint64_t row = 0; row < k; row++) {
+        double c = (double)correct[row * numPredictors + i];
+        double m = (double)(branches[row] - correct[row * numPredictors + i]);
+        accuracyResiduals += (c - accuracy * branches[row]) * (c - accuracy * branches[row]);
+        mpkiResiduals     += (m - mispredictionsPerInstruction * instructions[row]) * (m - mispredictionsPerInstruction * instructions[row]);
+      }
+      double meanBranches = (double)sumBranches / k;
+      double meanInstructions = (double)sumInstructions / k;
+
+      out << configLabel(results[i].config) << "\t" << accuracy << "\t";
+      if (k > 1) {
+        out << z95 * std::sqrt(accuracyResiduals / (k - 1) / k) / meanBranches;
+      } else {
+        out << "-";
+      }
+      out << "\t" << 1000.0 * mispredictionsPerInstruction << "\t";
+      if (k > 1) {
+        out << 1000.0 * z95 * std::sqrt(mpkiResiduals / (k - 1) / k) / meanInstructions;
+      } else {
+        out << "-";
+      }
+      out << "\t" << (uint64_t)(mispredictionsPerInstruction * totalInstructions) << std::endl;
+    }
+  }
+};
+
+#endif // BRANCH_PREDICTORS_H
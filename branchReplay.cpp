@@ -0,0 +1,386 @@
+/* Trace replay driver */
+// Runs the branch predictors over a trace recorded by the Pin tool with
+// -record_trace, without Pin. The trace is memory-mapped and decoded one chunk
+// at a time, and the counters are printed in the same layout as the Pin tool.
+//
+// Every configuration is independent of the others, so each one is a job for a
+// pool of -threads worker threads. With -segments the trace is also cut into
+// pieces at chunk boundaries that are replayed in parallel, each by a predictor
+// that is first trained on the -warmup branches before its segment without
+// counting them. The accuracy of every segment is then printed as well.
+//
+//   g++ -O2 -std=c++11 -pthread branchReplay.cpp -o branchReplay
+//   ./branchReplay -BP_type gshare -num_BP_entries 4096 trace.bpt
+//   ./branchReplay -sweep gshare:4096,tage:4096 trace.bpt
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "branchPredictors.h"
+#include "branchTrace.h"
+
+/* A branch predictor together with the configuration it was built from and its counters */
+//
+struct ReplayedPredictor {
+  BranchPredictorConfig config;
+  BranchPredictorInterface *predictor;
+  BranchPredictorStats stats;
+
+  // Runs the predictor over a batch of branches without virtual calls
+  void (*simulateBatch)(ReplayedPredictor &replayed, const BranchEvent *events, uint32_t numEvents);
+};
+
+template <class Predictor>
+static void ReplayBranchBatch(ReplayedPredictor &replayed, const BranchEvent *events, uint32_t numEvents) {
+  SimulateBranches(*static_cast<Predictor *>(replayed.predictor), events, numEvents, replayed.stats);
+}
+
+/* Creates the predictor of a ReplayedPredictor for CreateBranchPredictorOfType() */
+//
+struct ReplayedPredictorFactory {
+  ReplayedPredictor &replayed;
+
+  template <class Predictor>
+  void create() {
+    replayed.predictor = new Predictor(replayed.config);
+    replayed.simulateBatch = ReplayBranchBatch<Predictor>;
+  }
+};
+
+/* Consecutive chunks of the trace replayed by one job */
+//
+struct TraceSegment {
+  uint64_t firstChunk;
+  uint64_t endChunk;
+};
+
+/* One configuration replayed over one segment, with the counters of that segment */
+//
+struct ReplayJob {
+  uint32_t config;
+  uint32_t segment;
+  BranchPredictorStats stats;
+  BranchStreamStats stream;
+  bool failed;
+};
+
+// Replays the segment of job with a new predictor of its configuration. The chunks
+// are decoded straight from the mapped trace; those before the segment only supply
+// the warm-up branches, which train the predictor without being counted
+//
+static void RunReplayJob(const uint8_t *data, const std::vector<BranchTraceChunk> &chunks, const TraceSegment &segment,
+                         uint64_t warmup, const BranchPredictorConfig &config, ReplayJob &job) {
+  ReplayedPredictor replayed;
+  replayed.config = config;
+  ReplayedPredictorFactory factory = {replayed};
+  CreateBranchPredictorOfType(config, factory);
+
+  uint64_t segmentStart = chunks[segment.firstChunk].firstEvent;
+  uint64_t warmupStart = segmentStart > warmup ? segmentStart - warmup : 0;
+  uint64_t chunk = segment.firstChunk;
+  while (chunk > 0 && chunks[chunk].firstEvent > warmupStart) {
+    chunk--;
+  }
+
+  std::vector<BranchEvent> events(BRANCH_TRACE_EVENTS_PER_CHUNK);
+  job.failed = false;
+  for (; chunk < segment.endChunk; chunk++) {
+    const BranchTraceChunk &entry = chunks[chunk];
+    if (!DecodeBranchTraceChunk(data + entry.offset + sizeof(BranchTraceChunkHeader), entry.payloadBytes, entry.numEvents, events.data())) {
+      job.failed = true;
+      break;
+    }
+
+    // branches [begin, counted) of this chunk are warm-up, the rest belong to the segment
+    uint32_t begin = 0;
+    uint32_t counted = 0;
+    if (entry.firstEvent < warmupStart) {
+      begin = warmupStart - entry.firstEvent;
+    }
+    if (entry.firstEvent < segmentStart) {
+      counted = std::min<uint64_t>(segmentStart - entry.firstEvent, entry.numEvents);
+    }
+    if (counted > begin) {
+      BranchPredictorStats warmupStats;
+      replayed.simulateBatch(replayed, events.data() + begin, counted - begin);
+      replayed.stats = warmupStats;
+    }
+    for (uint32_t i = counted; i < entry.numEvents; i++) {
+      job.stream.record(events[i].taken);
+    }
+    replayed.simulateBatch(replayed, events.data() + counted, entry.numEvents - counted);
+  }
+
+  job.stats = replayed.stats;
+  delete replayed.predictor;
+}
+
+static void Usage() {
+  std::cerr << "Usage: branchReplay [options] trace" << std::endl
+            << "Replays a branch trace recorded with -record_trace. The options are those of the Pin tool:" << std::endl
+            << "  -o file                  output file name (BP_stats.out)" << std::endl
+            << "  -output_format format    text, json or csv (text); json and csv hold the totals only" << std::endl
+            << "  -BP_type type            always_taken, local, gshare, tournament, tage, perceptron or hybrid (always_taken)" << std::endl
+            << "  -num_BP_entries n        number of entries in a branch predictor (1024)" << std::endl
+            << "  -num_LHT_entries n       number of entries in the local history table (128)" << std::endl
+            << "  -local_history_bits n    local history length in bits (0: log2 of num_BP_entries)" << std::endl
+            << "  -global_history_bits n   global history length in bits (0: log2 of num_BP_entries, 200 for tage, 32 for perceptron)" << std::endl
+            << "  -hybrid_components list  predictor types combined by -BP_type hybrid, separated by + (local+gshare)" << std::endl
+            << "  -chooser_history_bits n  global history bits in the hybrid chooser index (0)" << std::endl
+            << "  -update_delay n          branches between the prediction of a branch and its update (0)" << std::endl
+            << "  -sweep list              several configurations, as for the Pin tool" << std::endl
+            << "and for the replay itself:" << std::endl
+            << "  -threads n               number of worker threads (0: one per core)" << std::endl
+            << "  -segments n              number of trace segments replayed in parallel (1)" << std::endl
+            << "  -warmup n                branches before a segment used to train its predictor (1000000)" << std::endl;
+  std::exit(EXIT_FAILURE);
+}
+
+static uint64_t ParseNumber(const char *option, const char *value) {
+  char *end;
+  uint64_t number = std::strtoull(value, &end, 0);
+  if (*value == '\0' || *end != '\0') {
+    std::cerr << "Error: " << option << " expects a number. Replay will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  return number;
+}
+
+int main(int argc, char *argv[]) {
+  BranchPredictorConfig config;
+  config.type              = "always_taken";
+  config.numEntries        = 1024;
+  config.numLHTEntries     = 128;
+  config.localHistoryBits  = 0;
+  config.globalHistoryBits = 0;
+
+  std::string outputFile = "BP_stats.out";
+  std::string outputFormat = "text";
+  std::string sweep;
+  std::string traceFile;
+  uint64_t numThreads = 0;
+  uint64_t numSegments = 1;
+  uint64_t warmup = 1000000;
+
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    if (option[0] != '-') {
+      if (!traceFile.empty()) {
+        Usage();
+      }
+      traceFile = option;
+      continue;
+    }
+    if (i + 1 == argc) {
+      Usage();
+    }
+    const char *value = argv[++i];
+    if      (option == "-o")                    outputFile                = value;
+    else if (option == "-output_format")        outputFormat              = value;
+    else if (option == "-BP_type")              config.type               = value;
+    else if (option == "-num_BP_entries")       config.numEntries         = ParseNumber(argv[i - 1], value);
+    else if (option == "-num_LHT_entries")      config.numLHTEntries      = ParseNumber(argv[i - 1], value);
+    else if (option == "-local_history_bits")   config.localHistoryBits   = ParseNumber(argv[i - 1], value);
+    else if (option == "-global_history_bits")  config.globalHistoryBits  = ParseNumber(argv[i - 1], value);
+    else if (option == "-hybrid_components")    config.hybridComponents   = value;
+    else if (option == "-chooser_history_bits") config.chooserHistoryBits = ParseNumber(argv[i - 1], value);
+    else if (option == "-update_delay")         config.updateDelay        = ParseNumber(argv[i - 1], value);
+    else if (option == "-sweep")                sweep                     = value;
+    else if (option == "-threads")              numThreads                = ParseNumber(argv[i - 1], value);
+    else if (option == "-segments")             numSegments               = ParseNumber(argv[i - 1], value);
+    else if (option == "-warmup")               warmup                    = ParseNumber(argv[i - 1], value);
+    else                                        Usage();
+  }
+  if (traceFile.empty()) {
+    Usage();
+  }
+  if (outputFormat != "text" && outputFormat != "json" && outputFormat != "csv") {
+    std::cerr << "Error: -output_format must be text, json or csv. Replay will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  std::vector<BranchPredictorConfig> configs;
+  if (sweep.empty()) {
+    configs.push_back(config);
+  }
+  else if (!ParseSweepConfigs(sweep, config, configs)) {
+    std::cerr << "Error: Malformed -sweep list. Replay will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  // Every job creates its own predictor, only check the configurations here
+  for (uint32_t i = 0; i < configs.size(); i++) {
+    const char *error = CheckBranchPredictorConfig(configs[i]);
+    if (error) {
+      std::cerr << "Error: " << error << " Replay will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+
+    ReplayedPredictor replayed;
+    replayed.config = configs[i];
+    ReplayedPredictorFactory factory = {replayed};
+    if (!CreateBranchPredictorOfType(configs[i], factory)) {
+      std::cerr << "Error: No such type of branch predictor. Replay will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    delete replayed.predictor;
+    std::cerr << "Using " << configs[i].type << " BP with " << configs[i].numEntries << " entries." << std::endl;
+  }
+
+  // Map the whole trace, the kernel reads it in as the chunks are decoded
+  int fd = open(traceFile.c_str(), O_RDONLY);
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    std::cerr << "Error: Could not open " << traceFile << ". Replay will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+  uint64_t size = status.st_size;
+  const uint8_t *data = NULL;
+  if (size > 0) {
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      std::cerr << "Error: Could not map " << traceFile << ". Replay will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    data = (const uint8_t *)mapping;
+  }
+  close(fd);
+
+  std::vector<BranchTraceChunk> chunks;
+  if (!FindBranchTraceChunks(data, size, chunks)) {
+    std::cerr << "Error: " << traceFile << " is not a branch trace or is corrupt. Replay will be terminated." << std::endl;
+    std::exit(EXIT_FAILURE);
+  }
+
+  // Cut the trace into segments of about the same number of chunks
+  if (numSegments == 0 || numSegments > chunks.size()) {
+    numSegments = chunks.empty() ? 1 : chunks.size();
+  }
+  std::vector<TraceSegment> segments(numSegments);
+  for (uint64_t i = 0; i < numSegments; i++) {
+    segments[i].firstChunk = chunks.size() * i / numSegments;
+    segments[i].endChunk = chunks.size() * (i + 1) / numSegments;
+  }
+
+  std::vector<ReplayJob> jobs;
+  for (uint32_t i = 0; i < configs.size(); i++) {
+    for (uint32_t j = 0; j < numSegments && !chunks.empty(); j++) {
+      ReplayJob job;
+      job.config = i;
+      job.segment = j;
+      jobs.push_back(job);
+    }
+  }
+
+  // Workers take the next job until none is left
+  if (numThreads == 0) {
+    numThreads = std::max(std::thread::hardware_concurrency(), 1U);
+  }
+  if (numThreads > jobs.size()) {
+    numThreads = jobs.size();
+  }
+  std::atomic<uint64_t> nextJob(0);
+  std::vector<std::thread> workers;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  for (uint64_t i = 0; i < numThreads; i++) {
+    workers.push_back(std::thread([&]() {
+      for (uint64_t j = nextJob++; j < jobs.size(); j = nextJob++) {
+        ReplayJob &job = jobs[j];
+        RunReplayJob(data, chunks, segments[job.segment], warmup, configs[job.config], job);
+      }
+    }));
+  }
+  for (uint64_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (data) {
+    munmap((void *)data, size);
+  }
+
+  // Add up the segments of every configuration. The jobs of any one configuration
+  // cover the whole trace, so those of the first one give the counts of the stream
+  std::vector<ReplayedPredictor> predictors(configs.size());
+  BranchStreamStats stream;
+  for (uint32_t i = 0; i < jobs.size(); i++) {
+    if (jobs[i].failed) {
+      std::cerr << "Error: " << traceFile << " has a corrupt chunk. Replay will be terminated." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    predictors[jobs[i].config].config = configs[jobs[i].config];
+    predictors[jobs[i].config].stats.merge(jobs[i].stats);
+    if (jobs[i].config == 0) {
+      stream.merge(jobs[i].stream);
+    }
+  }
+
+  // The report is put together in memory and written to the file in one go. A trace
+  // has no instruction counts, so json and csv leave those fields empty
+  std::ostringstream out;
+  if (outputFormat != "text") {
+    BranchResultOptions options;
+    options.push_back(std::make_pair(std::string("trace"),    traceFile));
+    options.push_back(std::make_pair(std::string("sweep"),    sweep));
+    options.push_back(std::make_pair(std::string("threads"),  std::to_string(numThreads)));
+    options.push_back(std::make_pair(std::string("segments"), std::to_string(numSegments)));
+    options.push_back(std::make_pair(std::string("warmup"),   std::to_string(warmup)));
+    if (outputFormat == "json") {
+      WriteBranchPredictorResultsJSON(out, stream, predictors, 0, seconds, options);
+    }
+    else {
+      WriteBranchPredictorResultsCSV(out, stream, predictors, 0, seconds, options);
+    }
+  }
+  else {
+    WriteBranchPredictorReport(out, stream, predictors);
+  }
+  if (outputFormat == "text" && numSegments > 1) {
+    // Accuracy of each configuration on each segment
+    out << std::endl
+        << "Segment\tFirst branch\tNumber of branches\tBP_type\tnum_BP_entries\tPrediction accuracy\tNumber of correct predictions" << std::endl;
+    for (uint32_t i = 0; i < jobs.size(); i++) {
+      const ReplayJob &job = jobs[i];
+      out << job.segment                                                                         << "\t"
+          << chunks[segments[job.segment].firstChunk].firstEvent                                 << "\t"
+          << job.stream.conditionalBranchesCount                                                 << "\t"
+          << configs[job.config].type                                                            << "\t"
+          << configs[job.config].numEntries                                                      << "\t"
+          << (double)job.stats.correctPredictionCount / (double)job.stream.conditionalBranchesCount << "\t"
+          << job.stats.correctPredictionCount                                                    << std::endl;
+    }
+  }
+  std::ofstream file(outputFile.c_str());
+  file << out.str();
+  file.close();
+  if (!file) {
+    std::cerr << "Warning: Could not write " << outputFile << "." << std::endl;
+  }
+
+  std::cerr << "Replayed " << stream.conditionalBranchesCount << " branches in " << seconds << " s on " << numThreads << " threads ("
+            << (double)stream.conditionalBranchesCount * predictors.size() / seconds << " predictions/s)." << std::endl;
+  for (uint32_t i = 0; i < predictors.size(); i++) {
+    const ReplayedPredictor &replayed = predictors[i];
+    if (predictors.size() > 1) {
+      std::cerr << replayed.config.type << " " << replayed.config.numEntries << ":\t";
+    }
+    std::cerr << "Prediction accuracy:\t" << (double)replayed.stats.correctPredictionCount / (double)stream.conditionalBranchesCount << std::endl;
+  }
+  return 0;
+}
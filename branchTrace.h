@@ -0,0 +1,265 @@
+#ifndef BRANCH_TRACE_H
+#define BRANCH_TRACE_H
+
+/* Binary branch traces */
+// Written by the Pin tool with -record_trace and read by the replay driver.
+// The file starts with the 8 byte magic "BPTRACE\0" and a 32-bit version,
+// followed by chunks of up to 65536 branches. Each chunk has a header with the
+// number of branches and the size of its payload; the payload holds the outcomes,
+// one bit per branch (least significant bit first), followed by the PCs as
+// zigzag LEB128 deltas from the previous PC of the same chunk. The first delta
+// of a chunk is taken from 0, so every chunk can be decoded on its own.
+// Since version 2 the chunks are followed by an index with the position of every
+// chunk and a footer pointing to it, so a reader can start at any chunk without
+// scanning the file. Traces without an index (version 1, or a run that did not
+// finish) are still read by scanning the chunk headers.
+//
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "branchPredictors.h"
+
+static const char BRANCH_TRACE_MAGIC[8] = {'B', 'P', 'T', 'R', 'A', 'C', 'E', '\0'};
+static const char BRANCH_TRACE_INDEX_MAGIC[8] = {'B', 'P', 'I', 'N', 'D', 'E', 'X', '\0'};
+static const uint32_t BRANCH_TRACE_VERSION = 2;
+static const uint32_t BRANCH_TRACE_EVENTS_PER_CHUNK = 1 << 16;
+
+struct BranchTraceChunkHeader {
+  uint32_t numEvents;
+  uint32_t payloadBytes;
+};
+
+/* Entry of the chunk index: where a chunk starts and which branches it holds */
+//
+struct BranchTraceChunk {
+  uint64_t offset;
+  uint64_t firstEvent;
+  uint32_t numEvents;
+  uint32_t payloadBytes;
+};
+
+/* Last bytes of an indexed trace */
+//
+struct BranchTraceFooter {
+  uint64_t indexOffset;
+  uint64_t numChunks;
+  char magic[8];
+};
+
+class BranchTraceWriter {
+
+private:
+
+  std::ofstream file;
+  std::vector<uint8_t> outcomes;
+  std::vector<uint8_t> deltas;
+  uint32_t numEvents;
+  uint64_t previousPC;
+
+  // chunks written so far, and the size of the file
+  std::vector<BranchTraceChunk> chunks;
+  uint64_t fileOffset;
+  uint64_t numWrittenEvents;
+
+  void writeChunk() {
+    if (numEvents == 0) {
+      return;
+    }
+    BranchTraceChunkHeader header;
+    header.numEvents = numEvents;
+    header.payloadBytes = (numEvents + 7) / 8 + deltas.size();
+    file.write((const char *)&header, sizeof(header));
+    file.write((const char *)outcomes.data(), (numEvents + 7) / 8);
+    file.write((const char *)deltas.data(), deltas.size());
+
+    BranchTraceChunk chunk;
+    chunk.offset = fileOffset;
+    chunk.firstEvent = numWrittenEvents;
+    chunk.numEvents = header.numEvents;
+    chunk.payloadBytes = header.payloadBytes;
+    chunks.push_back(chunk);
+    fileOffset += sizeof(header) + header.payloadBytes;
+    numWrittenEvents += numEvents;
+
+    std::fill(outcomes.begin(), outcomes.end(), 0);
+    deltas.clear();
+    numEvents = 0;
+    previousPC = 0;
+  }
+
+public:
+
+  BranchTraceWriter() : outcomes(BRANCH_TRACE_EVENTS_PER_CHUNK / 8, 0), numEvents(0), previousPC(0), fileOffset(0), numWrittenEvents(0) {
+    // at most 10 bytes for each varint
+    deltas.reserve(BRANCH_TRACE_EVENTS_PER_CHUNK * 10);
+  }
+
+  bool open(const std::string &fileName) {
+    file.open(fileName.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(BRANCH_TRACE_MAGIC, sizeof(BRANCH_TRACE_MAGIC));
+    file.write((const char *)&BRANCH_TRACE_VERSION, sizeof(BRANCH_TRACE_VERSION));
+    fileOffset = sizeof(BRANCH_TRACE_MAGIC) + sizeof(BRANCH_TRACE_VERSION);
+    return file.good();
+  }
+
+  void append(const BranchEvent *events, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+      outcomes[numEvents / 8] |= (uint8_t)(events[i].taken ? 1 : 0) << (numEvents % 8);
+
+      int64_t delta = (int64_t)(events[i].pc - previousPC);
+      uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+      while (zigzag >= 0x80) {
+        deltas.push_back((uint8_t)(zigzag | 0x80));
+        zigzag >>= 7;
+      }
+      deltas.push_back((uint8_t)zigzag);
+      previousPC = events[i].pc;
+
+      if (++numEvents == BRANCH_TRACE_EVENTS_PER_CHUNK) {
+        writeChunk();
+      }
+    }
+  }
+
+  void close() {
+    writeChunk();
+
+    BranchTraceFooter footer;
+    footer.indexOffset = fileOffset;
+    footer.numChunks = chunks.size();
+    std::copy(BRANCH_TRACE_INDEX_MAGIC, BRANCH_TRACE_INDEX_MAGIC + sizeof(footer.magic), footer.magic);
+    file.write((const char *)chunks.data(), chunks.size() * sizeof(BranchTraceChunk));
+    file.write((const char *)&footer, sizeof(footer));
+    file.close();
+  }
+};
+
+// Checks the magic and version at the start of a trace and returns the size of
+// that file header, or 0 if data is not a trace this code can read
+//
+inline uint64_t CheckBranchTraceHeader(const uint8_t *data, uint64_t size, uint32_t &version) {
+  if (size < sizeof(BRANCH_TRACE_MAGIC) + sizeof(version) ||
+      !std::equal(BRANCH_TRACE_MAGIC, BRANCH_TRACE_MAGIC + sizeof(BRANCH_TRACE_MAGIC), (const char *)data)) {
+    return 0;
+  }
+  std::memcpy(&version, data + sizeof(BRANCH_TRACE_MAGIC), sizeof(version));
+  if (version == 0 || version > BRANCH_TRACE_VERSION) {
+    return 0;
+  }
+  return sizeof(BRANCH_TRACE_MAGIC) + sizeof(version);
+}
+
+// Reads the chunk index from the footer of the trace mapped at data, checking
+// every entry against the chunk header it points to. Returns false if the trace
+// has no usable index
+//
+inline bool ReadBranchTraceIndex(const uint8_t *data, uint64_t size, uint64_t dataOffset, std::vector<BranchTraceChunk> &chunks) {
+  BranchTraceFooter footer;
+  if (size - dataOffset < sizeof(footer)) {
+    return false;
+  }
+  std::memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+  if (!std::equal(BRANCH_TRACE_INDEX_MAGIC, BRANCH_TRACE_INDEX_MAGIC + sizeof(footer.magic), footer.magic) ||
+      footer.indexOffset < dataOffset || footer.indexOffset > size - sizeof(footer) ||
+      (size - sizeof(footer) - footer.indexOffset) / sizeof(BranchTraceChunk) != footer.numChunks ||
+      (size - sizeof(footer) - footer.indexOffset) % sizeof(BranchTraceChunk) != 0) {
+    return false;
+  }
+
+  chunks.resize(footer.numChunks);
+  std::memcpy(chunks.data(), data + footer.indexOffset, footer.numChunks * sizeof(BranchTraceChunk));
+  uint64_t offset = dataOffset;
+  uint64_t firstEvent = 0;
+  for (uint64_t i = 0; i < chunks.size(); i++) {
+    BranchTraceChunkHeader header;
+    if (chunks[i].offset != offset || chunks[i].firstEvent != firstEvent ||
+        footer.indexOffset - offset < sizeof(header)) {
+      return false;
+    }
+    std::memcpy(&header, data + offset, sizeof(header));
+    if (header.numEvents == 0 || header.numEvents > BRANCH_TRACE_EVENTS_PER_CHUNK ||
+        header.numEvents != chunks[i].numEvents || header.payloadBytes != chunks[i].payloadBytes ||
+        footer.indexOffset - offset - sizeof(header) < header.payloadBytes) {
+      return false;
+    }
+    offset += sizeof(header) + header.payloadBytes;
+    firstEvent += header.numEvents;
+  }
+  return offset == footer.indexOffset;
+}
+
+// Finds the chunks of the trace mapped at data, from its index if it has one and
+// otherwise by walking the chunk headers. Returns false if the trace is truncated
+// or corrupt
+//
+inline bool FindBranchTraceChunks(const uint8_t *data, uint64_t size, std::vector<BranchTraceChunk> &chunks) {
+  uint32_t version;
+  uint64_t offset = CheckBranchTraceHeader(data, size, version);
+  if (offset == 0) {
+    return false;
+  }
+  if (version >= 2 && ReadBranchTraceIndex(data, size, offset, chunks)) {
+    return true;
+  }
+
+  chunks.clear();
+  uint64_t firstEvent = 0;
+  while (offset < size) {
+    BranchTraceChunkHeader header;
+    if (size - offset < sizeof(header)) {
+      return false;
+    }
+    std::memcpy(&header, data + offset, sizeof(header));
+    if (header.numEvents == 0 || header.numEvents > BRANCH_TRACE_EVENTS_PER_CHUNK ||
+        size - offset - sizeof(header) < header.payloadBytes) {
+      return false;
+    }
+    BranchTraceChunk chunk;
+    chunk.offset = offset;
+    chunk.firstEvent = firstEvent;
+    chunk.numEvents = header.numEvents;
+    chunk.payloadBytes = header.payloadBytes;
+    chunks.push_back(chunk);
+    offset += sizeof(header) + header.payloadBytes;
+    firstEvent += header.numEvents;
+  }
+  return true;
+}
+
+// Decodes the payload of one chunk into events, which must have room for
+// numEvents branches. Returns false if the payload ends before the last PC
+//
+inline bool DecodeBranchTraceChunk(const uint8_t *payload, uint32_t payloadBytes, uint32_t numEvents, BranchEvent *events) {
+  uint32_t outcomeBytes = (numEvents + 7) / 8;
+  if (payloadBytes < outcomeBytes) {
+    return false;
+  }
+  const uint8_t *delta = payload + outcomeBytes;
+  const uint8_t *end = payload + payloadBytes;
+  uint64_t pc = 0;
+
+  for (uint32_t i = 0; i < numEvents; i++) {
+    events[i].taken = (payload[i / 8] >> (i % 8)) & 1;
+
+    uint64_t zigzag = 0;
+    for (uint32_t shift = 0; ; shift += 7) {
+      if (delta == end || shift > 63) {
+        return false;
+      }
+      uint8_t byte = *delta++;
+      zigzag |= (uint64_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+    pc += (uint64_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    events[i].pc = pc;
+  }
+  return true;
+}
+
+#endif // BRANCH_TRACE_H